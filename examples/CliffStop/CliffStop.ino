@@ -0,0 +1,40 @@
+#include "ArduRoomba.h"
+
+ArduRoomba roomba(2, 3, 4); // rxPin, txPin, brcPin
+ArduRoomba::RoombaInfos infos = {};
+
+char sensorlist[] = {ARDUROOMBA_SENSOR_BUMPANDWEELSDROPS,
+                     ARDUROOMBA_SENSOR_CLIFFLEFT,
+                     ARDUROOMBA_SENSOR_CLIFFFRONTLEFT,
+                     ARDUROOMBA_SENSOR_CLIFFFRONTRIGHT,
+                     ARDUROOMBA_SENSOR_CLIFFRIGHT,
+                     0}; // end of list
+
+// Called by the stream decoder in the frame that reports the cliff
+void stopOnCliff(byte packetID, byte previous, byte current) {
+  if (current) {
+    roomba.halt();
+  }
+}
+
+void stopOnWheelDrop(byte packetID, byte previous, byte current) {
+  if (current & 0x0C) {
+    roomba.halt();
+  }
+}
+
+void setup() {
+  Serial.begin(19200);
+  roomba.roombaSetup();
+
+  roomba.onCliff(stopOnCliff);
+  roomba.onWheelDrop(stopOnWheelDrop);
+  roomba.resetStream();
+  roomba.queryStream(sensorlist);
+
+  roomba.drive(100, -32768); // 100 mm/s, radius -32768 means straight
+}
+
+void loop() {
+  roomba.poll(&infos);
+}
@@ -0,0 +1,96 @@
+#include "ArduRoomba.h"
+#include "ArduRoombaMock.h"
+
+// Decoder and command encoder timings without a robot: a mock link replays
+// stream frames, whole, split in small chunks, then with corrupted bytes.
+ArduRoombaMockStream mock;
+ArduRoomba roomba(mock, -1); // no BRC pin, the OI is never woken up
+ArduRoomba::RoombaInfos infos = {};
+
+char sensorlist[] = {ARDUROOMBA_SENSOR_BUMPANDWEELSDROPS,
+                     ARDUROOMBA_SENSOR_CLIFFLEFT,
+                     ARDUROOMBA_SENSOR_CLIFFFRONTLEFT,
+                     ARDUROOMBA_SENSOR_CLIFFFRONTRIGHT,
+                     ARDUROOMBA_SENSOR_CLIFFRIGHT,
+                     ARDUROOMBA_SENSOR_MODE,
+                     ARDUROOMBA_SENSOR_VOLTAGE,
+                     ARDUROOMBA_SENSOR_CURRENT,
+                     ARDUROOMBA_SENSOR_LEFTENCODERCOUNTS,
+                     ARDUROOMBA_SENSOR_RIGHTENCODERCOUNTS,
+                     0}; // end of list
+
+// IDs and values of one frame of the list above
+const byte content[] = {7, 0, 9, 0, 10, 0, 11, 0, 12, 0, 35, 2,
+                        22, 0x3A, 0x98, 23, 0xFF, 0x38, 43, 0x12, 0x34, 44, 0x12, 0x30};
+byte capture[4 * (sizeof(content) + 3)];
+
+void run(const char *name, byte chunkMin, byte chunkMax, unsigned int corruptEvery) {
+  mock.rewind();
+  mock.setChunk(chunkMin, chunkMax);
+  mock.setCorruption(corruptEvery);
+  roomba.resetLinkStats();
+
+  unsigned long start = micros();
+  unsigned long elapsed;
+  do {
+    mock.deliver();
+    roomba.poll(&infos);
+    elapsed = micros() - start;
+  } while (elapsed < 1000000UL);
+
+  ArduRoomba::LinkStats stats = roomba.linkStats();
+  Serial.print(name);
+  Serial.print(": ");
+  Serial.print(stats.framesOk * 1000000.0 / elapsed, 0);
+  Serial.print(" frames/s, ");
+  Serial.print(stats.framesOk ? elapsed * 1000.0 / stats.framesOk : 0, 0);
+  Serial.print(" ns/frame, decode ");
+  Serial.print(stats.decodeAverage());
+  Serial.print(" us, checksum errors ");
+  Serial.println(stats.checksumErrors);
+}
+
+void encoders() {
+  const unsigned int count = 1000;
+  unsigned long start = micros();
+  for (unsigned int i = 0; i < count; i++) {
+    roomba.driveDirect(i, -i);
+  }
+  unsigned long drive = micros() - start;
+
+  start = micros();
+  for (unsigned int i = 0; i < count; i++) {
+    roomba.beginCommands();
+    roomba.driveDirect(i, -i);
+    roomba.leds(0, i, 255);
+    roomba.digitLedsRaw('0' + i % 10, 'E', 'S', 'T'); // new digits, an unchanged display isn't sent
+    roomba.endCommands();
+  }
+  unsigned long burst = micros() - start;
+
+  Serial.print("driveDirect: ");
+  Serial.print(drive * 1000.0 / count, 0);
+  Serial.print(" ns, 3 command burst: ");
+  Serial.print(burst * 1000.0 / count, 0);
+  Serial.println(" ns");
+}
+
+void setup() {
+  Serial.begin(115200);
+  ArduRoomba::setLogOutput(NULL);
+
+  unsigned int length = 0;
+  for (byte i = 0; i < 4; i++) {
+    length += ArduRoombaMockStream::frame(content, sizeof(content), capture + length);
+  }
+  mock.load(capture, length);
+  roomba.queryStream(sensorlist);
+
+  run("whole frames", sizeof(content) + 3, sizeof(content) + 3, 0);
+  run("1 - 8 byte chunks", 1, 8, 0);
+  run("1 bad byte in 200", sizeof(content) + 3, sizeof(content) + 3, 200);
+  encoders();
+}
+
+void loop() {
+}
@@ -23,38 +23,19 @@ void loop()
     switch (incomingByte)
     {
     case 'w': // Assuming 'w' is the command to go forward
-      // Serial.println("inside w switch");
-      roomba.halt();
-      delay(50);
-      roomba.goForward();
-      delay(50);
-      Serial.println("Sent goForward to OI");
+      roomba.setDrive(500, ARDUROOMBA_RADIUS_STRAIGHT);
       break;
     case 's': // Assuming 's' is the command to go backward
-      roomba.halt();
-      delay(50);
-      roomba.goBackward();
-      delay(50);
-      Serial.println("Sent goBackward to OI");
+      roomba.setDrive(-500, ARDUROOMBA_RADIUS_STRAIGHT);
       break;
     case 'a': // Assuming 'a' is the command to turn left
-      roomba.halt();
-      delay(50);
-      roomba.turnLeft();
-      delay(50);
-      Serial.println("Sent turnLeft to OI");
+      roomba.setDrive(200, 1);
       break;
     case 'd': // Assuming 'd' is the command to turn right
-      roomba.halt();
-      delay(50);
-      roomba.turnRight();
-      delay(50);
-      Serial.println("Sent turnRight to OI");
+      roomba.setDrive(200, -1);
       break;
     case 'e': // Assuming 'e' is the command to stop
-      roomba.halt();
-      delay(50);
-      Serial.println("Sent halt to OI");
+      roomba.setDrive(0, 0);
       break;
     case 'r':
       roomba.roombaSetup();
@@ -63,4 +44,10 @@ void loop()
       break;
     }
   }
+
+  // Only the latest key reaches the OI, at most once per drive interval
+  if (roomba.serviceDrive())
+  {
+    Serial.println("Sent drive setpoint to OI");
+  }
 }
@@ -1,6 +1,7 @@
 #include "ArduRoomba.h"
 
 ArduRoomba roomba(2, 3, 4); // rxPin, txPin, brcPin
+ArduRoomba::RoombaInfos infos = {};
 
 void setup()
 {
@@ -10,6 +11,18 @@ void setup()
 
 void loop()
 {
-    // Read and print the sensor data (occurs every 15ms)
+    // Read and print the raw sensor data of group 100
     roomba.sensors(100);
+
+    // Or decode a query into infos, here the battery packets 21 - 26
+    if (roomba.querySensor(&infos, ARDUROOMBA_SENSOR_GROUP_21_26))
+    {
+        Serial.print("Voltage: ");
+        Serial.print(infos.voltage);
+        Serial.print(" mV, charge: ");
+        Serial.print(infos.batteryCharge);
+        Serial.print(" / ");
+        Serial.print(infos.batteryCapacity);
+        Serial.println(" mAh");
+    }
 }
@@ -2,12 +2,12 @@
 
 ArduRoomba roomba(2, 3, 4); // rxPin, txPin, brcPin
 ArduRoomba::RoombaInfos infos = {};
-ArduRoomba::RoombaInfos update = {};
+ArduRoomba::SensorMask changed;
 
   // warning don't request to many sensors
   // stream data time slot = 15ms
   // if the roomba doesn't have time to return all the sensor's data
-  // the stream will be unstable
+  // the stream will be unstable, queryStream() refuses such lists
   char sensorlist[] = {ARDUROOMBA_SENSOR_MODE,
                        ARDUROOMBA_SENSOR_TEMPERATURE,
                        ARDUROOMBA_SENSOR_VOLTAGE,
@@ -17,22 +17,34 @@ ArduRoomba::RoombaInfos update = {};
                        ARDUROOMBA_SENSOR_CLIFFLEFT,
                        ARDUROOMBA_SENSOR_CLIFFFRONTLEFT,
                        ARDUROOMBA_SENSOR_CLIFFRIGHT,
-                       ARDUROOMBA_SENSOR_CLIFFFRONTRIGHT};
+                       ARDUROOMBA_SENSOR_CLIFFFRONTRIGHT,
+                       0}; // end of list
 
 void setup() {
   Serial.begin(19200);
   roomba.roombaSetup();
   roomba.safe();
 
+  Serial.print("stream frame bytes = ");
+  Serial.print(ArduRoomba::streamFrameBytes(sensorlist));
+  Serial.print(" / ");
+  Serial.println(roomba.streamSlotBytes());
+
   roomba.resetStream();
-  roomba.queryStream(sensorlist);
+  if (!roomba.queryStream(sensorlist)) {
+    Serial.print("only the first packets fit: ");
+    Serial.println(roomba.planStream(sensorlist));
+  }
 }
 
 void loop() {
-  if (roomba.refreshData(&update)) {
-    printDiffAndHydrate(&infos,&update);
-  } else if (update.attempt > 2) {
-    long noSerialDuration = millis() - update.lastSuccedRefresh;
+  if (roomba.refreshData(&infos, &changed)) {
+    // only look at the sensors that changed in the new frames
+    for (int id = changed.next(-1); id >= 0; id = changed.next(id)) {
+      printSensor(id, &infos);
+    }
+  } else if (infos.attempt > 2) {
+    long noSerialDuration = millis() - infos.lastSuccedRefresh;
     if (noSerialDuration > 300) {
       Serial.print("NO SERIAL (");
       Serial.print(noSerialDuration, DEC);
@@ -42,70 +54,53 @@ void loop() {
   }
 }
 
-void printDiffAndHydrate(ArduRoomba::RoombaInfos *a, ArduRoomba::RoombaInfos *b) {
-  if (b->mode != a->mode) {
-    a->mode = b->mode;
+void printSensor(int packetID, ArduRoomba::RoombaInfos *infos) {
+  switch (packetID) {
+  case ARDUROOMBA_SENSOR_MODE:
     Serial.print("mode = ");
-    Serial.println(a->mode);
-  }
-  if (b->wall != a->wall) {
-    a->wall = b->wall;
+    Serial.println(infos->mode);
+    break;
+  case ARDUROOMBA_SENSOR_WALL:
     Serial.print("wall = ");
-    Serial.println(a->wall);
-  }
-  if (b->cliffLeft != a->cliffLeft) {
-    a->cliffLeft = b->cliffLeft;
+    Serial.println(infos->wall);
+    break;
+  case ARDUROOMBA_SENSOR_CLIFFLEFT:
     Serial.print("cliffLeft = ");
-    Serial.println(a->cliffLeft);
-  }
-  if (b->cliffFrontLeft != a->cliffFrontLeft) {
-    a->cliffFrontLeft = b->cliffFrontLeft;
+    Serial.println(infos->cliffLeft);
+    break;
+  case ARDUROOMBA_SENSOR_CLIFFFRONTLEFT:
     Serial.print("cliffFrontLeft = ");
-    Serial.println(a->cliffFrontLeft);
-  }
-  if (b->cliffRight != a->cliffRight) {
-    a->cliffRight = b->cliffRight;
+    Serial.println(infos->cliffFrontLeft);
+    break;
+  case ARDUROOMBA_SENSOR_CLIFFRIGHT:
     Serial.print("cliffRight = ");
-    Serial.println(a->cliffRight);
-  }
-  if (b->cliffFrontRight != a->cliffFrontRight) {
-    a->cliffFrontRight = b->cliffFrontRight;
+    Serial.println(infos->cliffRight);
+    break;
+  case ARDUROOMBA_SENSOR_CLIFFFRONTRIGHT:
     Serial.print("cliffFrontRight = ");
-    Serial.println(a->cliffFrontRight);
-  }
-  if (b->voltage != a->voltage) {
-    a->voltage = b->voltage;
+    Serial.println(infos->cliffFrontRight);
+    break;
+  case ARDUROOMBA_SENSOR_VOLTAGE:
     Serial.print("voltage = ");
-    Serial.println(a->voltage);
-  }
-  if (b->batteryCharge != a->batteryCharge) {
-    a->batteryCharge = b->batteryCharge;
+    Serial.println(infos->voltage);
+    break;
+  case ARDUROOMBA_SENSOR_BATTERYCHARGE:
     Serial.print("batteryCharge = ");
-    Serial.println(a->batteryCharge);
-  }
-  if (b->temperature != a->temperature) {
-    a->temperature = b->temperature;
+    Serial.println(infos->batteryCharge);
+    break;
+  case ARDUROOMBA_SENSOR_TEMPERATURE:
     Serial.print("temperature = ");
-    Serial.println(a->temperature, DEC); // print temperature as an ASCII-encoded decimal ( range -128 to 127)
-  }
-  if (a->bumpRight != b->bumpRight) {
-    a->bumpRight = b->bumpRight;
+    Serial.println(infos->temperature, DEC); // print temperature as an ASCII-encoded decimal ( range -128 to 127)
+    break;
+  case ARDUROOMBA_SENSOR_BUMPANDWEELSDROPS:
     Serial.print("bumpRight = ");
-    Serial.println(a->bumpRight);
-  }
-  if (a->bumpLeft != b->bumpLeft) {
-    a->bumpLeft = b->bumpLeft;
+    Serial.println(infos->bumpRight());
     Serial.print("bumpLeft = ");
-    Serial.println(a->bumpLeft);
-  }
-  if (a->wheelDropRight != b->wheelDropRight) {
-    a->wheelDropRight = b->wheelDropRight;
+    Serial.println(infos->bumpLeft());
     Serial.print("wheelDropRight = ");
-    Serial.println(a->wheelDropRight);
-  }
-  if (a->wheelDropLeft != b->wheelDropLeft) {
-    a->wheelDropLeft = b->wheelDropLeft;
+    Serial.println(infos->wheelDropRight());
     Serial.print("wheelDropLeft = ");
-    Serial.println(a->wheelDropLeft);
+    Serial.println(infos->wheelDropLeft());
+    break;
   }
-}
\ No newline at end of file
+}
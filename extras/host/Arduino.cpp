@@ -0,0 +1,57 @@
+#include "Arduino.h"
+#include <chrono>
+#include <stdio.h>
+#include <thread>
+
+static const std::chrono::steady_clock::time_point _start = std::chrono::steady_clock::now();
+
+unsigned long micros()
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - _start).count();
+}
+
+unsigned long millis() { return micros() / 1000; }
+void delay(unsigned long ms) { std::this_thread::sleep_for(std::chrono::milliseconds(ms)); }
+void delayMicroseconds(unsigned int us) { std::this_thread::sleep_for(std::chrono::microseconds(us)); }
+
+size_t Print::write(const uint8_t *buffer, size_t size)
+{
+  size_t written = 0;
+  while (size--) {
+    written += write(*buffer++);
+  }
+  return written;
+}
+
+size_t Print::print(long value, int base)
+{
+  if (base == DEC && value < 0) {
+    return print('-') + print((unsigned long)-value, base);
+  }
+  return print((unsigned long)value, base);
+}
+
+size_t Print::print(unsigned long value, int base)
+{
+  char text[8 * sizeof(long) + 1];
+  char *digit = text + sizeof(text) - 1;
+  *digit = 0;
+  do {
+    byte rest = value % base;
+    *--digit = rest < 10 ? '0' + rest : 'A' + rest - 10;
+    value /= base;
+  } while (value);
+  return write(digit);
+}
+
+size_t Print::print(double value, int digits)
+{
+  char text[32];
+  snprintf(text, sizeof(text), "%.*f", digits, value);
+  return write(text);
+}
+
+HardwareSerial Serial;
+
+size_t HardwareSerial::write(uint8_t value) { return fputc(value, stdout) == EOF ? 0 : 1; }
+size_t HardwareSerial::write(const uint8_t *buffer, size_t size) { return fwrite(buffer, 1, size, stdout); }
@@ -0,0 +1,8 @@
+// The DecodeBenchmark sketch, run once on the desktop
+#include "../../examples/DecodeBenchmark/DecodeBenchmark.ino"
+
+int main()
+{
+  setup();
+  return 0;
+}
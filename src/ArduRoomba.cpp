@@ -1,267 +1,667 @@
 #include "ArduRoomba.h"
+#include "ArduRoombaOdometry.h"
+#include <stddef.h>
 
+// Library messages, compiled in up to ARDUROOMBA_LOG_LEVEL
+#if ARDUROOMBA_LOG_LEVEL > ARDUROOMBA_LOG_NONE
+Print *ArduRoomba::_logOutput = &Serial;
+#define ARDUROOMBA_LOG(...) do { if (_logOutput) { _logOutput->print(__VA_ARGS__); } } while (0)
+#else
+Print *ArduRoomba::_logOutput = NULL;
+#endif
+
+#if ARDUROOMBA_LOG_LEVEL >= ARDUROOMBA_LOG_ERRORS
+#define ARDUROOMBA_ERROR(...) ARDUROOMBA_LOG(__VA_ARGS__)
+#else
+#define ARDUROOMBA_ERROR(...) do {} while (0)
+#endif
+#if ARDUROOMBA_LOG_LEVEL >= ARDUROOMBA_LOG_INFO
+#define ARDUROOMBA_INFO(...) ARDUROOMBA_LOG(__VA_ARGS__)
+#else
+#define ARDUROOMBA_INFO(...) do {} while (0)
+#endif
+#if ARDUROOMBA_LOG_LEVEL >= ARDUROOMBA_LOG_DEBUG
+#define ARDUROOMBA_DEBUG(...) ARDUROOMBA_LOG(__VA_ARGS__)
+#else
+#define ARDUROOMBA_DEBUG(...) do {} while (0)
+#endif
+
+#if ARDUROOMBA_SOFTWARESERIAL
 ArduRoomba::ArduRoomba(int rxPin, int txPin, int brcPin)
-    : _rxPin(rxPin), _txPin(txPin), _brcPin(brcPin), _irobot(rxPin, txPin)
+    : _rxPin(rxPin), _txPin(txPin), _brcPin(brcPin), _irobot(&_softSerialPort), _softSerialPort(rxPin, txPin)
+{
+  _softSerial = &_softSerialPort;
+}
+
+ArduRoomba::~ArduRoomba()
 {
-  // Constructor implementation
+  if (_softSerial) {
+    _softSerialPort.~SoftwareSerial();
+  }
 }
+#endif
 
-byte ArduRoomba::_parseOneByteStreamBuffer(byte *packets, int &start) 
+ArduRoomba::ArduRoomba(HardwareSerial &serial, int brcPin)
+    : _rxPin(-1), _txPin(-1), _brcPin(brcPin), _irobot(&serial), _hardSerial(&serial)
 {
-  byte v = packets[start];
-  start++;
-  return v;
 }
 
-int ArduRoomba::_parseTwoByteStreamBuffer(byte *packets, int &start) 
+ArduRoomba::ArduRoomba(Stream &stream, int brcPin)
+    : _rxPin(-1), _txPin(-1), _brcPin(brcPin), _irobot(&stream)
 {
-  int v = (int)(packets[start] * 256 + packets[start + 1]);
-  start += 2;
-  return v;
 }
 
-void ArduRoomba::_parseAndFillOneByteStreamBuffer(byte *packets, int &start, bool *bytes) 
+void ArduRoomba::_openLink(long baud)
 {
-  byte oneByteParsedPacket = (byte)_parseOneByteStreamBuffer(packets, start);
-  for(int i=0; i < 7; i++) {
-    bytes[i]=(oneByteParsedPacket >> i) & 1;
+  if (_hardSerial) {
+    _hardSerial->begin(baud);
+    _linkBaud = baud;
   }
+#if ARDUROOMBA_SOFTWARESERIAL
+  if (_softSerial) {
+    _softSerial->begin(baud);
+    _linkBaud = baud;
+  }
+#endif
+  // a Stream opened by the sketch keeps the rate given to setLinkRate()
 }
 
-bool ArduRoomba::_parseStreamBuffer(byte *packets, int len, RoombaInfos *infos) 
+bool ArduRoomba::RoombaInfos::sameSensors(const RoombaInfos &other) const
 {
-  int i = 0;
-  byte packetID;
-  bool oneByteParsedPacketBits[7]={false};
-  while (i < len) {
-    packetID = (byte)_parseOneByteStreamBuffer(packets, i);
-    switch (packetID) {
-    case ARDUROOMBA_SENSOR_MODE:
-      infos->mode = (byte)_parseOneByteStreamBuffer(packets, i);
-      break;
-    case ARDUROOMBA_SENSOR_IOSTREAMNUMPACKETS:
-      infos->ioStreamNumPackets = (byte)_parseOneByteStreamBuffer(packets, i);
-      break;
-    case ARDUROOMBA_SENSOR_SONGNUMBER:
-      infos->songNumber = (byte)_parseOneByteStreamBuffer(packets, i);
-      break;
-    case ARDUROOMBA_SENSOR_IROPCODE:
-      infos->irOpcode = (byte)_parseOneByteStreamBuffer(packets, i);
-      break;
-    case ARDUROOMBA_SENSOR_INFRAREDCHARACTERLEFT:
-      infos->infraredCharacterLeft = (byte)_parseOneByteStreamBuffer(packets, i);
-      break;
-    case ARDUROOMBA_SENSOR_INFRAREDCHARACTERRIGHT:
-      infos->infraredCharacterRight = (byte)_parseOneByteStreamBuffer(packets, i);
-      break;
-    case ARDUROOMBA_SENSOR_DIRTDETECT:
-      infos->dirtdetect = (int)_parseOneByteStreamBuffer(packets, i);
-      break;
-    case ARDUROOMBA_SENSOR_CHARGINGSTATE:
-      infos->chargingState = (byte)_parseOneByteStreamBuffer(packets, i);
-      break;
-    case ARDUROOMBA_SENSOR_VOLTAGE:
-      infos->voltage = (int)_parseTwoByteStreamBuffer(packets, i);
-      break;
-    case ARDUROOMBA_SENSOR_CURRENT:
-      infos->current = (int)_parseTwoByteStreamBuffer(packets, i);
-      break;
-    case ARDUROOMBA_SENSOR_VELOCITY:
-      infos->velocity = (int)_parseTwoByteStreamBuffer(packets, i);
-      break;
-    case ARDUROOMBA_SENSOR_LEFTMOTORCURRENT:
-      infos->leftMotorCurrent = (int)_parseTwoByteStreamBuffer(packets, i);
-      break;
-    case ARDUROOMBA_SENSOR_RIGHTMOTORCURRENT:
-      infos->rightMotorCurrent = (int)_parseTwoByteStreamBuffer(packets, i);
-      break;
-    case ARDUROOMBA_SENSOR_MAINBRUSHMOTORCURRENT:
-      infos->mainBrushMotorCurrent = (int)_parseTwoByteStreamBuffer(packets, i);
-      break;
-    case ARDUROOMBA_SENSOR_SIDEBRUSHMOTORCURRENT:
-      infos->sideBrushMotorCurrent = (int)_parseTwoByteStreamBuffer(packets, i);
-      break;
-    case ARDUROOMBA_SENSOR_RIGHTVELOCITY:
-      infos->rightVelocity = (int)_parseTwoByteStreamBuffer(packets, i);
-      break;
-    case ARDUROOMBA_SENSOR_LEFTVELOCITY:
-      infos->leftVelocity = (int)_parseTwoByteStreamBuffer(packets, i);
-      break;
-    case ARDUROOMBA_SENSOR_RADIUS:
-      infos->radius = (int)_parseTwoByteStreamBuffer(packets, i);
-      break;
-    case ARDUROOMBA_SENSOR_WALLSIGNAL:
-      infos->wallSignal = (unsigned int)_parseTwoByteStreamBuffer(packets, i);
-      break;
-    case ARDUROOMBA_SENSOR_CLIFFLEFTSIGNAL:
-      infos->cliffLeftSignal = (unsigned int)_parseTwoByteStreamBuffer(packets, i);
-      break;
-    case ARDUROOMBA_SENSOR_CLIFFFRONTLEFTSIGNAL:
-      infos->cliffFrontLeftSignal = (unsigned int)_parseTwoByteStreamBuffer(packets, i);
-      break;
-    case ARDUROOMBA_SENSOR_CLIFFRIGHTSIGNAL:
-      infos->cliffRightSignal = (unsigned int)_parseTwoByteStreamBuffer(packets, i);
-      break;
-    case ARDUROOMBA_SENSOR_CLIFFFRONTRIGHTSIGNAL:
-      infos->cliffFrontRightSignal = (unsigned int)_parseTwoByteStreamBuffer(packets, i);
-      break;
-    case ARDUROOMBA_SENSOR_LIGHTBUMPLEFTSIGNAL:
-      infos->lightBumpLeftSignal = (unsigned int)_parseTwoByteStreamBuffer(packets, i);
-      break;
-    case ARDUROOMBA_SENSOR_LIGHTBUMPFRONTLEFTSIGNAL:
-      infos->lightBumpFrontLeftSignal = (unsigned int)_parseTwoByteStreamBuffer(packets, i);
-      break;
-    case ARDUROOMBA_SENSOR_LIGHTBUMPCENTERLEFTSIGNAL:
-      infos->lightBumpCenterLeftSignal = (unsigned int)_parseTwoByteStreamBuffer(packets, i);
-      break;
-    case ARDUROOMBA_SENSOR_LIGHTBUMPCENTERRIGHTSIGNAL:
-      infos->lightBumpCenterLeftSignal = (unsigned int)_parseTwoByteStreamBuffer(packets, i);
-      break;
-    case ARDUROOMBA_SENSOR_LIGHTBUMPFRONTRIGHTSIGNAL:
-      infos->lightBumpFrontRightSignal = (unsigned int)_parseTwoByteStreamBuffer(packets, i);
-      break;
-    case ARDUROOMBA_SENSOR_LIGHTBUMPRIGHTSIGNAL:
-      infos->lightBumpRightSignal = (unsigned int)_parseTwoByteStreamBuffer(packets, i);
-      break;
-    case ARDUROOMBA_SENSOR_TEMPERATURE:
-      infos->temperature = (char)_parseOneByteStreamBuffer(packets, i);
-      break;
-    case ARDUROOMBA_SENSOR_BATTERYCHARGE:
-      infos->batteryCharge = (int)_parseTwoByteStreamBuffer(packets, i);
-      break;
-    case ARDUROOMBA_SENSOR_LEFTENCODERCOUNTS:
-      infos->leftEncoderCounts = (int)_parseTwoByteStreamBuffer(packets, i);
-      break;
-    case ARDUROOMBA_SENSOR_RIGHTENCODERCOUNTS:
-      infos->rightEncoderCounts = (int)_parseTwoByteStreamBuffer(packets, i);
-      break;
-    case ARDUROOMBA_SENSOR_BATTERYCAPACITY:
-      infos->batteryCapacity = (int)_parseTwoByteStreamBuffer(packets, i);
-      break;
-    case ARDUROOMBA_SENSOR_WALL:
-      infos->wall = (bool)_parseOneByteStreamBuffer(packets, i);
-      break;
-    case ARDUROOMBA_SENSOR_SONGPLAYING:
-      infos->songPlaying = (bool)_parseOneByteStreamBuffer(packets, i);
-      break;
-    case ARDUROOMBA_SENSOR_VIRTUALWALL:
-      infos->virtualWall = (bool)_parseOneByteStreamBuffer(packets, i);
-      break;
-    case ARDUROOMBA_SENSOR_CLIFFLEFT:
-      infos->cliffLeft = (bool)_parseOneByteStreamBuffer(packets, i);
-      break;
-    case ARDUROOMBA_SENSOR_CLIFFFRONTLEFT:
-      infos->cliffFrontLeft = (bool)_parseOneByteStreamBuffer(packets, i);
-      break;
-    case ARDUROOMBA_SENSOR_CLIFFRIGHT:
-      infos->cliffRight = (bool)_parseOneByteStreamBuffer(packets, i);
-      break;
-    case ARDUROOMBA_SENSOR_CLIFFFRONTRIGHT:
-      infos->cliffFrontRight = (bool)_parseOneByteStreamBuffer(packets, i);
-      break;
-    case ARDUROOMBA_SENSOR_BUMPANDWEELSDROPS:
-      _parseAndFillOneByteStreamBuffer(packets, i, oneByteParsedPacketBits);
-      infos->bumpRight = oneByteParsedPacketBits[0];
-      infos->bumpLeft = oneByteParsedPacketBits[1];
-      infos->wheelDropRight =oneByteParsedPacketBits[2];
-      infos->wheelDropLeft = oneByteParsedPacketBits[3];
-      break;
-    case ARDUROOMBA_SENSOR_WHEELOVERCURRENTS:
-      _parseAndFillOneByteStreamBuffer(packets, i, oneByteParsedPacketBits);
-      infos->sideBrushOvercurrent = oneByteParsedPacketBits[0];
-      infos->vacuumOvercurrent = oneByteParsedPacketBits[1];
-      infos->mainBrushOvercurrent = oneByteParsedPacketBits[2];
-      infos->wheelRightOvercurrent = oneByteParsedPacketBits[3];
-      infos->wheelLeftOvercurrent = oneByteParsedPacketBits[4];
-      break;
-    case ARDUROOMBA_SENSOR_BUTTONS:
-      _parseAndFillOneByteStreamBuffer(packets, i, oneByteParsedPacketBits);
-      infos->cleanButton = oneByteParsedPacketBits[0];
-      infos->spotButton = oneByteParsedPacketBits[1];
-      infos->dockButton = oneByteParsedPacketBits[2];
-      infos->minuteButton = oneByteParsedPacketBits[3];
-      infos->hourButton = oneByteParsedPacketBits[4];
-      infos->dayButton = oneByteParsedPacketBits[5];
-      infos->scheludeButton = oneByteParsedPacketBits[6];
-      infos->clockButton = oneByteParsedPacketBits[7];
-      break;
-    case ARDUROOMBA_SENSOR_LIGHTBUMPER:
-      _parseAndFillOneByteStreamBuffer(packets, i, oneByteParsedPacketBits);
-      infos->lightBumperLeft = oneByteParsedPacketBits[0];
-      infos->lightBumperFrontLeft = oneByteParsedPacketBits[1];
-      infos->lightBumperCenterLeft = oneByteParsedPacketBits[2];
-      infos->lightBumperCenterRight = oneByteParsedPacketBits[3];
-      infos->lightBumperFrontRight = oneByteParsedPacketBits[4];
-      infos->lightBumperRight = oneByteParsedPacketBits[5];
-      break;
-    case ARDUROOMBA_SENSOR_CHARGERAVAILABLE:
-      _parseAndFillOneByteStreamBuffer(packets, i, oneByteParsedPacketBits);
-      infos->internalChargerAvailable = oneByteParsedPacketBits[0];
-      infos->homeBaseChargerAvailable = oneByteParsedPacketBits[1];
-      break;
-    case ARDUROOMBA_SENSOR_STASIS:
-      _parseAndFillOneByteStreamBuffer(packets, i, oneByteParsedPacketBits);
-      infos->stasisToggling = oneByteParsedPacketBits[0];
-      infos->stasisDisabled = oneByteParsedPacketBits[1];
-      break;
-    default:
-      Serial.print("ArduRoomba::_parseStreamBuffer error: Unhandled Packet ID (");
-      Serial.print(packetID, DEC);
-      Serial.print(")\n");
+  const size_t first = offsetof(RoombaInfos, voltage);
+  const size_t last = offsetof(RoombaInfos, stasis) + 1;
+  return memcmp((const byte *)this + first, (const byte *)&other + first, last - first) == 0;
+}
+
+bool ArduRoomba::SensorMask::any() const
+{
+  for (byte i = 0; i < sizeof(bits); i++) {
+    if (bits[i]) {
+      return true;
+    }
+  }
+  return false;
+}
+
+int ArduRoomba::SensorMask::next(int packetID) const
+{
+  for (int id = packetID + 1; id < 64; id++) {
+    byte chunk = bits[id >> 3] >> (id & 7);
+    if (chunk == 0) {
+      id |= 7; // nothing left in this byte
+    } else if (chunk & 1) {
+      return id;
+    }
+  }
+  return -1;
+}
+
+void ArduRoomba::SensorMask::merge(const SensorMask &other)
+{
+  for (byte i = 0; i < sizeof(bits); i++) {
+    bits[i] |= other.bits[i];
+  }
+}
+
+static_assert(sizeof(ArduRoomba::RoombaInfos) <= 256, "StreamField::dest is a byte offset");
+
+// Packets of the Create 2 OI spec: 0 - 58, then the groups 100, 101, 106 and 107
+static constexpr ArduRoomba::PacketMeta _packetMeta[] PROGMEM = {
+    {26, ARDUROOMBA_FIELD_GROUP, 7, 26, 0, 0}, // 0, group of 7 - 26
+    {10, ARDUROOMBA_FIELD_GROUP, 7, 16, 0, 0}, // 1, group of 7 - 16
+    {6, ARDUROOMBA_FIELD_GROUP, 17, 20, 0, 0}, // 2, group of 17 - 20
+    {10, ARDUROOMBA_FIELD_GROUP, 21, 26, 0, 0}, // 3, group of 21 - 26
+    {14, ARDUROOMBA_FIELD_GROUP, 27, 34, 0, 0}, // 4, group of 27 - 34
+    {12, ARDUROOMBA_FIELD_GROUP, 35, 42, 0, 0}, // 5, group of 35 - 42
+    {52, ARDUROOMBA_FIELD_GROUP, 7, 42, 0, 0}, // 6, group of 7 - 42
+    {1, ARDUROOMBA_FIELD_BYTE, offsetof(ArduRoomba::RoombaInfos, bumpsAndWheelDrops), 0, 0, 15}, // 7
+    {1, ARDUROOMBA_FIELD_BYTE, offsetof(ArduRoomba::RoombaInfos, wall), 0, 0, 1}, // 8
+    {1, ARDUROOMBA_FIELD_BYTE, offsetof(ArduRoomba::RoombaInfos, cliffLeft), 0, 0, 1}, // 9
+    {1, ARDUROOMBA_FIELD_BYTE, offsetof(ArduRoomba::RoombaInfos, cliffFrontLeft), 0, 0, 1}, // 10
+    {1, ARDUROOMBA_FIELD_BYTE, offsetof(ArduRoomba::RoombaInfos, cliffFrontRight), 0, 0, 1}, // 11
+    {1, ARDUROOMBA_FIELD_BYTE, offsetof(ArduRoomba::RoombaInfos, cliffRight), 0, 0, 1}, // 12
+    {1, ARDUROOMBA_FIELD_BYTE, offsetof(ArduRoomba::RoombaInfos, virtualWall), 0, 0, 1}, // 13
+    {1, ARDUROOMBA_FIELD_BYTE, offsetof(ArduRoomba::RoombaInfos, wheelOvercurrents), 0, 0, 31}, // 14
+    {1, ARDUROOMBA_FIELD_BYTE, offsetof(ArduRoomba::RoombaInfos, dirtdetect), 0, 0, 255}, // 15
+    {1, ARDUROOMBA_FIELD_NODATA, 0, 0, 0, 0}, // 16, unused
+    {1, ARDUROOMBA_FIELD_BYTE, offsetof(ArduRoomba::RoombaInfos, irOpcode), 0, 0, 255}, // 17
+    {1, ARDUROOMBA_FIELD_BYTE, offsetof(ArduRoomba::RoombaInfos, buttons), 0, 0, 255}, // 18
+    {2, ARDUROOMBA_FIELD_WIDE | ARDUROOMBA_FIELD_SIGNED, offsetof(ArduRoomba::RoombaInfos, distance), 0, -32768, 32767}, // 19
+    {2, ARDUROOMBA_FIELD_WIDE | ARDUROOMBA_FIELD_SIGNED, offsetof(ArduRoomba::RoombaInfos, angle), 0, -32768, 32767}, // 20
+    {1, ARDUROOMBA_FIELD_BYTE, offsetof(ArduRoomba::RoombaInfos, chargingState), 0, 0, 5}, // 21
+    {2, ARDUROOMBA_FIELD_WIDE, offsetof(ArduRoomba::RoombaInfos, voltage), 0, 0, 65535}, // 22
+    {2, ARDUROOMBA_FIELD_WIDE | ARDUROOMBA_FIELD_SIGNED, offsetof(ArduRoomba::RoombaInfos, current), 0, -32768, 32767}, // 23
+    {1, ARDUROOMBA_FIELD_BYTE | ARDUROOMBA_FIELD_SIGNED, offsetof(ArduRoomba::RoombaInfos, temperature), 0, -128, 127}, // 24
+    {2, ARDUROOMBA_FIELD_WIDE, offsetof(ArduRoomba::RoombaInfos, batteryCharge), 0, 0, 65535}, // 25
+    {2, ARDUROOMBA_FIELD_WIDE, offsetof(ArduRoomba::RoombaInfos, batteryCapacity), 0, 0, 65535}, // 26
+    {2, ARDUROOMBA_FIELD_WIDE, offsetof(ArduRoomba::RoombaInfos, wallSignal), 0, 0, 1023}, // 27
+    {2, ARDUROOMBA_FIELD_WIDE, offsetof(ArduRoomba::RoombaInfos, cliffLeftSignal), 0, 0, 4095}, // 28
+    {2, ARDUROOMBA_FIELD_WIDE, offsetof(ArduRoomba::RoombaInfos, cliffFrontLeftSignal), 0, 0, 4095}, // 29
+    {2, ARDUROOMBA_FIELD_WIDE, offsetof(ArduRoomba::RoombaInfos, cliffFrontRightSignal), 0, 0, 4095}, // 30
+    {2, ARDUROOMBA_FIELD_WIDE, offsetof(ArduRoomba::RoombaInfos, cliffRightSignal), 0, 0, 4095}, // 31
+    {1, ARDUROOMBA_FIELD_NODATA, 0, 0, 0, 0}, // 32, unused
+    {2, ARDUROOMBA_FIELD_NODATA, 0, 0, 0, 0}, // 33, unused
+    {1, ARDUROOMBA_FIELD_BYTE, offsetof(ArduRoomba::RoombaInfos, chargersAvailable), 0, 0, 3}, // 34
+    {1, ARDUROOMBA_FIELD_BYTE, offsetof(ArduRoomba::RoombaInfos, mode), 0, 0, 3}, // 35
+    {1, ARDUROOMBA_FIELD_BYTE, offsetof(ArduRoomba::RoombaInfos, songNumber), 0, 0, 15}, // 36
+    {1, ARDUROOMBA_FIELD_BYTE, offsetof(ArduRoomba::RoombaInfos, songPlaying), 0, 0, 1}, // 37
+    {1, ARDUROOMBA_FIELD_BYTE, offsetof(ArduRoomba::RoombaInfos, ioStreamNumPackets), 0, 0, 108}, // 38
+    {2, ARDUROOMBA_FIELD_WIDE | ARDUROOMBA_FIELD_SIGNED, offsetof(ArduRoomba::RoombaInfos, velocity), 0, -500, 500}, // 39
+    {2, ARDUROOMBA_FIELD_WIDE | ARDUROOMBA_FIELD_SIGNED, offsetof(ArduRoomba::RoombaInfos, radius), 0, -32768, 32767}, // 40
+    {2, ARDUROOMBA_FIELD_WIDE | ARDUROOMBA_FIELD_SIGNED, offsetof(ArduRoomba::RoombaInfos, rightVelocity), 0, -500, 500}, // 41
+    {2, ARDUROOMBA_FIELD_WIDE | ARDUROOMBA_FIELD_SIGNED, offsetof(ArduRoomba::RoombaInfos, leftVelocity), 0, -500, 500}, // 42
+    {2, ARDUROOMBA_FIELD_WIDE, offsetof(ArduRoomba::RoombaInfos, leftEncoderCounts), 0, 0, 65535}, // 43
+    {2, ARDUROOMBA_FIELD_WIDE, offsetof(ArduRoomba::RoombaInfos, rightEncoderCounts), 0, 0, 65535}, // 44
+    {1, ARDUROOMBA_FIELD_BYTE, offsetof(ArduRoomba::RoombaInfos, lightBumper), 0, 0, 127}, // 45
+    {2, ARDUROOMBA_FIELD_WIDE, offsetof(ArduRoomba::RoombaInfos, lightBumpLeftSignal), 0, 0, 4095}, // 46
+    {2, ARDUROOMBA_FIELD_WIDE, offsetof(ArduRoomba::RoombaInfos, lightBumpFrontLeftSignal), 0, 0, 4095}, // 47
+    {2, ARDUROOMBA_FIELD_WIDE, offsetof(ArduRoomba::RoombaInfos, lightBumpCenterLeftSignal), 0, 0, 4095}, // 48
+    {2, ARDUROOMBA_FIELD_WIDE, offsetof(ArduRoomba::RoombaInfos, lightBumpCenterRightSignal), 0, 0, 4095}, // 49
+    {2, ARDUROOMBA_FIELD_WIDE, offsetof(ArduRoomba::RoombaInfos, lightBumpFrontRightSignal), 0, 0, 4095}, // 50
+    {2, ARDUROOMBA_FIELD_WIDE, offsetof(ArduRoomba::RoombaInfos, lightBumpRightSignal), 0, 0, 4095}, // 51
+    {1, ARDUROOMBA_FIELD_BYTE, offsetof(ArduRoomba::RoombaInfos, infraredCharacterLeft), 0, 0, 255}, // 52
+    {1, ARDUROOMBA_FIELD_BYTE, offsetof(ArduRoomba::RoombaInfos, infraredCharacterRight), 0, 0, 255}, // 53
+    {2, ARDUROOMBA_FIELD_WIDE | ARDUROOMBA_FIELD_SIGNED, offsetof(ArduRoomba::RoombaInfos, leftMotorCurrent), 0, -32768, 32767}, // 54
+    {2, ARDUROOMBA_FIELD_WIDE | ARDUROOMBA_FIELD_SIGNED, offsetof(ArduRoomba::RoombaInfos, rightMotorCurrent), 0, -32768, 32767}, // 55
+    {2, ARDUROOMBA_FIELD_WIDE | ARDUROOMBA_FIELD_SIGNED, offsetof(ArduRoomba::RoombaInfos, mainBrushMotorCurrent), 0, -32768, 32767}, // 56
+    {2, ARDUROOMBA_FIELD_WIDE | ARDUROOMBA_FIELD_SIGNED, offsetof(ArduRoomba::RoombaInfos, sideBrushMotorCurrent), 0, -32768, 32767}, // 57
+    {1, ARDUROOMBA_FIELD_BYTE, offsetof(ArduRoomba::RoombaInfos, stasis), 0, 0, 3}, // 58
+    {80, ARDUROOMBA_FIELD_GROUP, 7, 58, 0, 0}, // 100, group of 7 - 58
+    {28, ARDUROOMBA_FIELD_GROUP, 43, 58, 0, 0}, // 101, group of 43 - 58
+    {12, ARDUROOMBA_FIELD_GROUP, 46, 51, 0, 0}, // 106, group of 46 - 51
+    {9, ARDUROOMBA_FIELD_GROUP, 54, 58, 0, 0}, // 107, group of 54 - 58
+};
+
+// Every group carries the packets of its range back to back
+constexpr int _rangeSize(int first, int last)
+{
+  return first > last ? 0 : _packetMeta[first].size + _rangeSize(first + 1, last);
+}
+constexpr bool _groupConsistent(int index)
+{
+  return _packetMeta[index].format == ARDUROOMBA_FIELD_GROUP &&
+         _rangeSize(_packetMeta[index].dest, _packetMeta[index].last) == _packetMeta[index].size;
+}
+static_assert(_groupConsistent(0) && _groupConsistent(1) && _groupConsistent(2) && _groupConsistent(3) &&
+              _groupConsistent(4) && _groupConsistent(5) && _groupConsistent(6), "groups 0 - 6");
+static_assert(_groupConsistent(59) && _groupConsistent(60) && _groupConsistent(61) && _groupConsistent(62),
+              "groups 100 - 107");
+static_assert(_packetMeta[(int)RoombaPacket::Stasis].dest == offsetof(ArduRoomba::RoombaInfos, stasis) &&
+              _packetMeta[(int)RoombaPacket::LightBumpCenterRightSignal].dest ==
+                  offsetof(ArduRoomba::RoombaInfos, lightBumpCenterRightSignal), "table out of order");
+
+bool ArduRoomba::packetMeta(byte packetID, PacketMeta *meta)
+{
+  int index = packetID;
+  switch (packetID) {
+  case ARDUROOMBA_SENSOR_GROUP_7_58:
+    index = 59;
+    break;
+  case ARDUROOMBA_SENSOR_GROUP_43_58:
+    index = 60;
+    break;
+  case ARDUROOMBA_SENSOR_GROUP_46_51:
+    index = 61;
+    break;
+  case ARDUROOMBA_SENSOR_GROUP_54_58:
+    index = 62;
+    break;
+  default:
+    if (packetID > ARDUROOMBA_SENSOR_STASIS) {
       return false;
-      break;
     }
   }
+  memcpy_P(meta, &_packetMeta[index], sizeof(PacketMeta));
   return true;
 }
 
-bool ArduRoomba::_readStream() 
+bool ArduRoomba::_streamFieldFormat(byte packetID, byte *format, byte *dest)
 {
-  unsigned long timeout =
-      millis() + ARDUROOMBA_STREAM_TIMEOUT; // stream start every 15ms
-  while (!_irobot.available()) {
-    if (millis() > timeout) {
-      Serial.print("ArduRoomba::_readStream enable to read stream (serial timeout)\n");
-      return false; // Timed out
+  PacketMeta meta;
+  if (!packetMeta(packetID, &meta) || (meta.format & (ARDUROOMBA_FIELD_NODATA | ARDUROOMBA_FIELD_GROUP))) {
+    return false;
+  }
+  *format = meta.format;
+  *dest = meta.dest;
+  return true;
+}
+
+static_assert((ARDUROOMBA_RX_BUFFER_SIZE & ARDUROOMBA_RX_MASK) == 0 && ARDUROOMBA_RX_BUFFER_SIZE <= 256,
+              "ARDUROOMBA_RX_BUFFER_SIZE must be a power of two up to 256");
+
+bool ArduRoomba::_parseStreamBuffer(byte start, int len, RoombaInfos *infos) 
+{
+  if (len != _streamFrameSize) {
+    return false; // not the frame we asked for
+  }
+  for (int i = 0; i < _streamFieldCount; i++) {
+    const StreamField &field = _streamLayout[i];
+    if ((field.format & ARDUROOMBA_FIELD_TAGGED) &&
+        _rxBuffer[(start + field.offset - 1) & ARDUROOMBA_RX_MASK] != field.packetID) {
+      return false;
     }
   }
 
-  int state = ARDUROOMBA_STREAM_WAIT_HEADER;
-  _streamBufferCursor = 0;
-  byte streamSize;
-  byte lastChunk;
-  byte checksum = 0;
-  while (_irobot.available()) {
-    byte chunk = _irobot.read();
-    switch (state) {
-    case ARDUROOMBA_STREAM_WAIT_HEADER:
-      if (chunk == 19) {
-        state = ARDUROOMBA_STREAM_WAIT_SIZE;
-      }
-      break;
-    case ARDUROOMBA_STREAM_WAIT_SIZE:
-      streamSize = chunk;
-      state = ARDUROOMBA_STREAM_WAIT_CONTENT;
-      break;
-    case ARDUROOMBA_STREAM_WAIT_CONTENT:
-      if (_streamBufferCursor < streamSize) {
-        _streamBuffer[_streamBufferCursor] = chunk;
-        _streamBufferCursor++;
-      } else {
-        state = ARDUROOMBA_STREAM_WAIT_CHECKSUM;
+  _frameChanges.clear();
+  for (int i = 0; i < _streamFieldCount; i++) {
+    const StreamField &field = _streamLayout[i];
+    if (!(field.format & ARDUROOMBA_FIELD_NODATA)) {
+      _storeField(field.packetID, field.format, field.dest, start + field.offset, infos);
+    }
+  }
+  return true;
+}
+
+bool ArduRoomba::_parseFrame(byte start, int len, RoombaInfos *infos)
+{
+  unsigned long begin = micros();
+  if (_parseStreamBuffer(start, len, infos)) {
+    _drainCount = 0; // the OI switched to the new list
+    _frameEncoders = _streamEncoders;
+  } else if (_drainCount > 0 && _parseStreamList(_drainIDs, _drainCount, start, len, infos)) {
+    // Frames sent before a switch are still decoded with the previous list
+    _frameEncoders = false;
+  } else {
+    _linkStats.unknownPackets++; // the size was checked with the header
+    return false;
+  }
+
+  unsigned long end = micros();
+  unsigned int decode = end - begin;
+  if (_linkStats.framesOk == 0 || decode < _linkStats.decodeMin) {
+    _linkStats.decodeMin = decode;
+  }
+  if (decode > _linkStats.decodeMax) {
+    _linkStats.decodeMax = decode;
+  }
+  _linkStats.decodeTotal += decode;
+  if (_linkStats.framesOk > 0) {
+    unsigned long gap = end - _lastFrameAt;
+    if (_linkStats.framesOk == 1 || gap < _linkStats.gapMin) {
+      _linkStats.gapMin = gap;
+    }
+    if (gap > _linkStats.gapMax) {
+      _linkStats.gapMax = gap;
+    }
+    _linkStats.gapTotal += gap;
+  }
+  _lastFrameAt = end;
+  _linkStats.framesOk++;
+  return true;
+}
+
+ArduRoomba::LinkStats ArduRoomba::linkStats() const
+{
+  LinkStats stats = _linkStats;
+  stats.rxOverruns = _rxOverruns;
+  return stats;
+}
+
+void ArduRoomba::resetLinkStats()
+{
+  LinkStats empty = {};
+  _linkStats = empty;
+  _rxOverruns = 0;
+}
+
+bool ArduRoomba::_parseStreamList(const byte *packetIDs, byte count, byte start, int len, RoombaInfos *infos)
+{
+  // Slower than the compiled layout, only used for the few frames after a switch
+  int offset = 0;
+  for (int i = 0; i < count; i++) {
+    if (offset >= len || _rxBuffer[(start + offset) & ARDUROOMBA_RX_MASK] != packetIDs[i]) {
+      return false;
+    }
+    offset += 1 + packetSize(packetIDs[i]);
+  }
+  if (offset != len) {
+    return false;
+  }
+
+  _frameChanges.clear();
+  byte at = start;
+  for (int i = 0; i < count; i++) {
+    at += 1 + _storePacket(packetIDs[i], at + 1, infos);
+  }
+  return true;
+}
+
+byte ArduRoomba::_storePacket(byte packetID, byte at, RoombaInfos *infos)
+{
+  // Values of a packet or of the packets of a group, without ID bytes
+  PacketMeta meta;
+  if (!packetMeta(packetID, &meta)) {
+    return 0;
+  }
+  if (!(meta.format & ARDUROOMBA_FIELD_GROUP)) {
+    if (!(meta.format & ARDUROOMBA_FIELD_NODATA)) {
+      _storeField(packetID, meta.format, meta.dest, at, infos);
+    }
+    return meta.size;
+  }
+  byte size = 0;
+  for (byte id = meta.dest; id <= meta.last; id++) {
+    PacketMeta field;
+    packetMeta(id, &field);
+    if (!(field.format & ARDUROOMBA_FIELD_NODATA)) {
+      _storeField(id, field.format, field.dest, at + size, infos);
+    }
+    size += field.size;
+  }
+  return size;
+}
+
+void ArduRoomba::_storeField(byte packetID, byte format, byte dest, byte at, RoombaInfos *infos)
+{
+  at &= ARDUROOMBA_RX_MASK;
+  byte *dst = (byte *)infos + dest;
+  if (format & ARDUROOMBA_FIELD_WIDE) {
+    uint16_t value = ((uint16_t)_rxBuffer[at] << 8) | _rxBuffer[(at + 1) & ARDUROOMBA_RX_MASK];
+    if (*(uint16_t *)dst != value) {
+      *(uint16_t *)dst = value;
+      _frameChanges.set(packetID);
+    }
+  } else if (*dst != _rxBuffer[at]) {
+    byte previous = *dst;
+    *dst = _rxBuffer[at];
+    _frameChanges.set(packetID);
+    if (packetID <= ARDUROOMBA_SENSOR_WHEELOVERCURRENTS) {
+      _dispatchSafety(packetID, previous, *dst);
+    }
+  }
+}
+
+void ArduRoomba::_dispatchSafety(byte packetID, byte previous, byte current)
+{
+  switch (packetID) {
+  case ARDUROOMBA_SENSOR_BUMPANDWEELSDROPS:
+    if (_bumpHandler && ((previous ^ current) & 0x03)) {
+      _bumpHandler(packetID, previous, current);
+    }
+    if (_wheelDropHandler && ((previous ^ current) & 0x0C)) {
+      _wheelDropHandler(packetID, previous, current);
+    }
+    break;
+  case ARDUROOMBA_SENSOR_CLIFFLEFT:
+  case ARDUROOMBA_SENSOR_CLIFFFRONTLEFT:
+  case ARDUROOMBA_SENSOR_CLIFFFRONTRIGHT:
+  case ARDUROOMBA_SENSOR_CLIFFRIGHT:
+    if (_cliffHandler) {
+      _cliffHandler(packetID, previous, current);
+    }
+    break;
+  case ARDUROOMBA_SENSOR_VIRTUALWALL:
+    if (_virtualWallHandler) {
+      _virtualWallHandler(packetID, previous, current);
+    }
+    break;
+  case ARDUROOMBA_SENSOR_WHEELOVERCURRENTS:
+    if (_overcurrentHandler) {
+      _overcurrentHandler(packetID, previous, current);
+    }
+    break;
+  }
+}
+
+void ArduRoomba::_checkModeChange()
+{
+  if (_frameChanges.has(ARDUROOMBA_SENSOR_MODE)) {
+    forgetOutputs(); // the OI reset its LEDs, maybe not from one of our commands
+  }
+}
+
+void ArduRoomba::_handleFrame(RoombaInfos *infos)
+{
+  _changedSensors.merge(_frameChanges);
+  _checkModeChange();
+  if (_odometry && _frameEncoders) {
+    _odometry->update(*infos);
+  }
+  if (_signalsUpdate) {
+    _signalsUpdate(_signals, *infos);
+  }
+  if (_frameHandler) {
+    _frameHandler(*infos, _frameChanges);
+  }
+}
+
+void ArduRoomba::receiveByte(byte chunk)
+{
+  byte head = _rxHead;
+  byte next = (head + 1) & ARDUROOMBA_RX_MASK;
+  if (next == _rxTail) {
+    _rxOverruns++; // the decoder is too far behind
+    return;
+  }
+  _rxBuffer[head] = chunk;
+  _rxHead = next;
+}
+
+void ArduRoomba::receive()
+{
+  // bytes the port itself dropped since the last call, counted once per call
+#if ARDUROOMBA_SOFTWARESERIAL
+  if (_softSerial && _softSerial->overflow()) {
+    _rxOverruns++;
+  }
+#endif
+#ifdef SERIAL_RX_BUFFER_SIZE
+  if (_hardSerial && _hardSerial->available() >= SERIAL_RX_BUFFER_SIZE - 1) {
+    _rxOverruns++; // the UART ring is full, the following bytes were lost
+  }
+#endif
+  // stop when the ring is full, the port keeps the rest
+  while (((_rxHead + 1) & ARDUROOMBA_RX_MASK) != _rxTail && _irobot->available()) {
+    receiveByte(_irobot->read());
+  }
+}
+
+int ArduRoomba::_rxAvailable()
+{
+  if (!_rxExternal) {
+    receive();
+  }
+  return (_rxHead - _rxTail) & ARDUROOMBA_RX_MASK;
+}
+
+int ArduRoomba::_rxRead()
+{
+  if (_rxAvailable() == 0) {
+    return -1;
+  }
+  byte chunk = _rxBuffer[_rxTail];
+  _rxTail = (_rxTail + 1) & ARDUROOMBA_RX_MASK;
+  _rxScan = _rxTail; // whatever the decoder saw is gone
+  _streamState = ARDUROOMBA_STREAM_WAIT_HEADER;
+  return chunk;
+}
+
+void ArduRoomba::_rxSkip(byte count)
+{
+  _rxTail = (_rxTail + count) & ARDUROOMBA_RX_MASK;
+  _rxScan = _rxTail; // whatever the decoder saw is gone
+  _streamState = ARDUROOMBA_STREAM_WAIT_HEADER;
+}
+
+void ArduRoomba::_rxClear()
+{
+  while (_irobot->available()) {
+    _irobot->read();
+  }
+  _rxTail = _rxHead;
+  _rxScan = _rxTail;
+  _streamState = ARDUROOMBA_STREAM_WAIT_HEADER;
+}
+
+bool ArduRoomba::_readStream(RoombaInfos *infos)
+{
+  // Bytes stay in the ring until their frame is decoded or rejected. After
+  // a rejection the scan restarts one byte after the rejected header, so a
+  // real header hidden in a torn frame is still found.
+  bool decoded = false;
+  do {
+    if (!_rxExternal) {
+      receive();
+    }
+    byte head = _rxHead;
+    while (_rxScan != head) {
+      byte chunk = _rxBuffer[_rxScan];
+      _rxScan = (_rxScan + 1) & ARDUROOMBA_RX_MASK;
+      _streamChecksum += chunk;
+
+      switch (_streamState) {
+      case ARDUROOMBA_STREAM_WAIT_HEADER:
+        if (chunk == ARDUROOMBA_STREAM_HEADER) {
+          _streamChecksum = chunk;
+          _streamState = ARDUROOMBA_STREAM_WAIT_SIZE;
+        } else {
+          _rxTail = _rxScan;
+          _linkStats.bytesDiscarded++;
+        }
+        continue;
+      case ARDUROOMBA_STREAM_WAIT_SIZE:
+        _streamRemaining = chunk;
+        // Only the sizes of the current list, or of the one still draining,
+        // can start a frame. Waiting for any other size would stall the
+        // decoder, and the safety handlers, on a data byte that looked
+        // like a header.
+        if (chunk > ARDUROOMBA_STREAM_MAX_SIZE ||
+            (chunk != _streamFrameSize && !(_drainCount > 0 && chunk == _drainFrameSize))) {
+          _linkStats.lengthMismatches++;
+          break; // not a frame of ours, or the header was a data byte
+        }
+        _streamState = chunk ? ARDUROOMBA_STREAM_WAIT_CONTENT : ARDUROOMBA_STREAM_WAIT_CHECKSUM;
+        continue;
+      case ARDUROOMBA_STREAM_WAIT_CONTENT:
+        if (--_streamRemaining == 0) {
+          _streamState = ARDUROOMBA_STREAM_WAIT_CHECKSUM;
+        }
+        continue;
+      case ARDUROOMBA_STREAM_WAIT_CHECKSUM:
+        if (_streamChecksum != 0) {
+          _linkStats.checksumErrors++;
+          break;
+        }
+        if (_recorder) {
+          _recordFrame();
+        }
+        if (!_parseFrame(_rxTail + 2, _rxBuffer[(_rxTail + 1) & ARDUROOMBA_RX_MASK], infos)) {
+          break; // a frame that doesn't match the layout may still hide the real header
+        }
+        _handleFrame(infos);
+        decoded = true;
+        _rxTail = _rxScan;
+        _streamState = ARDUROOMBA_STREAM_WAIT_HEADER;
+        continue;
       }
-      break;
-    case ARDUROOMBA_STREAM_WAIT_CHECKSUM:
-      lastChunk = chunk;
-      state = ARDUROOMBA_STREAM_END;
+
+      // rejected, look for a header right after the one we started from
+      _linkStats.resyncs++;
+      _linkStats.bytesDiscarded++;
+      _rxTail = (_rxTail + 1) & ARDUROOMBA_RX_MASK;
+      _rxScan = _rxTail;
+      _streamState = ARDUROOMBA_STREAM_WAIT_HEADER;
+    }
+  } while (!_rxExternal && _irobot->available()); // the ring was full, there is more
+  return decoded;
+}
+
+void ArduRoomba::setRecorder(Print *out)
+{
+  _recorder = out;
+  _recordAt = millis();
+  _recordedBytes = 0;
+}
+
+void ArduRoomba::_recordFrame()
+{
+  // the frame is written straight from the ring, in two blocks when it wraps
+  unsigned long now = millis();
+  unsigned long elapsed = now - _recordAt;
+  _recordAt = now;
+  uint16_t delta = elapsed < 0xFFFF ? elapsed : 0xFFFF;
+  byte header[ARDUROOMBA_RECORD_HEADER] = {(byte)delta, (byte)(delta >> 8)};
+  _recorder->write(header, sizeof(header));
+  byte length = (_rxScan - _rxTail) & ARDUROOMBA_RX_MASK;
+  byte first = _rxTail + length <= ARDUROOMBA_RX_BUFFER_SIZE ? length : ARDUROOMBA_RX_BUFFER_SIZE - _rxTail;
+  _recorder->write(&_rxBuffer[_rxTail], first);
+  if (first < length) {
+    _recorder->write(_rxBuffer, length - first);
+  }
+  _recordedBytes += sizeof(header) + length;
+}
+
+bool ArduRoomba::sensorLocation(byte packetID, byte *offset, bool *wide, bool *isSigned)
+{
+  byte format;
+  if (!_streamFieldFormat(packetID, &format, offset)) {
+    return false;
+  }
+  *wide = format & ARDUROOMBA_FIELD_WIDE;
+  *isSigned = format & ARDUROOMBA_FIELD_SIGNED;
+  return true;
+}
+
+byte ArduRoomba::packetSize(byte packetID)
+{
+  PacketMeta meta;
+  return packetMeta(packetID, &meta) ? meta.size : 0;
+}
+
+int ArduRoomba::streamFrameBytes(const char *sensorlist)
+{
+  int bytes = 3; // header, size and checksum
+  for (int i = 0; sensorlist[i] != '\0'; i++) {
+    byte size = packetSize(sensorlist[i]);
+    if (size == 0) {
+      return -1;
+    }
+    bytes += 1 + size;
+  }
+  return bytes;
+}
+
+int ArduRoomba::streamSlotBytes() const
+{
+  return _linkBaud * ARDUROOMBA_STREAM_SLOT / 10000; // 10 bits per byte
+}
+
+int ArduRoomba::planStream(const char *sensorlist) const
+{
+  int budget = streamSlotBytes() - 3;
+  int count = 0;
+  for (; sensorlist[count] != '\0'; count++) {
+    byte size = packetSize(sensorlist[count]);
+    if (size == 0 || size + 1 > budget) {
       break;
     }
-    checksum += chunk;
+    budget -= size + 1;
   }
+  return count;
+}
 
-  bool isChecksum = (checksum & 0xFF) == 0;
-  bool isStreamEnd = state == ARDUROOMBA_STREAM_END;
-  return isStreamEnd && isChecksum;
+int ArduRoomba::suggestStreamGroup(const char *sensorlist) const
+{
+  int bytes = streamFrameBytes(sensorlist);
+  if (bytes < 0) {
+    return -1;
+  }
+  int best = -1;
+  for (int group = 0; group <= ARDUROOMBA_SENSOR_GROUP_54_58; group++) {
+    PacketMeta meta;
+    if (!packetMeta(group, &meta) || meta.format != ARDUROOMBA_FIELD_GROUP) {
+      continue;
+    }
+    bool covered = true;
+    for (int i = 0; covered && sensorlist[i] != '\0'; i++) {
+      covered = (byte)sensorlist[i] >= meta.dest && (byte)sensorlist[i] <= meta.last;
+    }
+    if (covered && 4 + meta.size < bytes) {
+      bytes = 4 + meta.size; // keep the smallest
+      best = group;
+    }
+  }
+  return best;
 }
 
 int ArduRoomba::_sensorsListLength(char sensorlist[]) 
@@ -274,326 +674,866 @@ int ArduRoomba::_sensorsListLength(char sensorlist[])
   return count;
 }
 
-void ArduRoomba::queryStream(char sensorlist[]) 
+bool ArduRoomba::_compileStreamPacket(byte packetID, StreamField *layout, int &fields, int &size)
+{
+  // layout is NULL when only counting
+  PacketMeta meta;
+  if (!packetMeta(packetID, &meta) || (meta.format & ARDUROOMBA_FIELD_NODATA)) {
+    return false; // unknown or unused packets are refused
+  }
+  if (!(meta.format & ARDUROOMBA_FIELD_GROUP)) {
+    if (layout && fields < ARDUROOMBA_STREAM_MAX_FIELDS) {
+      StreamField field = {packetID, (byte)(size + 1), (byte)(meta.format | ARDUROOMBA_FIELD_TAGGED), meta.dest};
+      layout[fields] = field;
+    }
+    fields++;
+    size += 1 + meta.size;
+    return true;
+  }
+
+  // group: one ID byte, then the values of its packets without their IDs
+  if (layout && fields < ARDUROOMBA_STREAM_MAX_FIELDS) {
+    StreamField tag = {packetID, (byte)(size + 1), ARDUROOMBA_FIELD_TAGGED | ARDUROOMBA_FIELD_NODATA, 0};
+    layout[fields] = tag;
+  }
+  fields++;
+  size++;
+  for (byte id = meta.dest; id <= meta.last; id++) {
+    PacketMeta field;
+    packetMeta(id, &field);
+    if (!(field.format & ARDUROOMBA_FIELD_NODATA)) {
+      if (layout && fields < ARDUROOMBA_STREAM_MAX_FIELDS) {
+        StreamField value = {id, (byte)size, field.format, field.dest};
+        layout[fields] = value;
+      }
+      fields++;
+    }
+    size += field.size; // unused packets are skipped
+  }
+  return true;
+}
+
+bool ArduRoomba::queryStream(char sensorlist[]) 
 {
-  Serial.print("ArduRoomba::queryStream:\n");
-  _nbSensorsStream = _sensorsListLength(sensorlist);
-  _irobot.write(148);
-  _irobot.write(_nbSensorsStream);
+  return queryStream(sensorlist, _sensorsListLength(sensorlist));
+}
+
+bool ArduRoomba::queryStream(const char *sensorlist, byte count)
+{
+  ARDUROOMBA_DEBUG(F("ArduRoomba::queryStream:\n"));
+
+  // check the whole list before touching the layout of the running stream
+  int fields = 0;
+  int size = 0;
+  for (int i = 0; i < count; i++) {
+    if (!_compileStreamPacket(sensorlist[i], NULL, fields, size)) {
+      ARDUROOMBA_ERROR(F("ArduRoomba::queryStream error: Unhandled Packet ID ("));
+      ARDUROOMBA_ERROR(sensorlist[i], DEC);
+      ARDUROOMBA_ERROR(F(")\n"));
+      return false;
+    }
+  }
+  if (fields > ARDUROOMBA_STREAM_MAX_FIELDS) {
+    ARDUROOMBA_ERROR(F("ArduRoomba::queryStream error: too many packets\n"));
+    return false;
+  }
+  if (size > ARDUROOMBA_STREAM_MAX_SIZE) {
+    ARDUROOMBA_ERROR(F("ArduRoomba::queryStream error: frame too large\n"));
+    return false;
+  }
+  if (size + 3 > streamSlotBytes()) {
+    ARDUROOMBA_ERROR(F("ArduRoomba::queryStream error: frame doesn't fit the stream slot, see planStream()\n"));
+    return false;
+  }
+
+  // A running stream is switched in place, the frames already sent with
+  // the previous list are still decoded until the first one of the new list
+  if (_nbSensorsStream > 0) {
+    memcpy(_drainIDs, _streamIDs, _nbSensorsStream);
+    _drainCount = _nbSensorsStream;
+    _drainFrameSize = _streamFrameSize;
+  }
+
+  fields = 0;
+  size = 0;
+  for (int i = 0; i < count; i++) {
+    _compileStreamPacket(sensorlist[i], _streamLayout, fields, size);
+  }
+  _streamFieldCount = fields;
+  _streamFrameSize = size;
+  _nbSensorsStream = count;
+  bool left = false, right = false;
+  for (int i = 0; i < fields; i++) {
+    left = left || _streamLayout[i].packetID == ARDUROOMBA_SENSOR_LEFTENCODERCOUNTS;
+    right = right || _streamLayout[i].packetID == ARDUROOMBA_SENSOR_RIGHTENCODERCOUNTS;
+  }
+  _streamEncoders = left && right;
+  memcpy(_streamIDs, sensorlist, count);
+  _streamProfile = NULL;
+  _streamPaused = false;
+
+  byte command[2 + ARDUROOMBA_STREAM_MAX_FIELDS] = {148, (byte)_nbSensorsStream};
   for (int i = 0; i < _nbSensorsStream; i++) {
-    _sensorsStream[i] = sensorlist[i];
-    Serial.print(" ");
-    Serial.print(_sensorsStream[i], DEC);
-    Serial.print("\n");
-    _irobot.write(_sensorsStream[i]);
+    ARDUROOMBA_DEBUG(F(" "));
+    ARDUROOMBA_DEBUG(sensorlist[i], DEC);
+    ARDUROOMBA_DEBUG(F("\n"));
+    command[2 + i] = sensorlist[i];
   }
+  _send(command, 2 + _nbSensorsStream);
+  return true;
+}
+
+bool ArduRoomba::setStreamProfile(const StreamProfile &profile)
+{
+  if (!queryStream(profile.sensors, strlen(profile.sensors))) {
+    return false;
+  }
+  _streamProfile = profile.name;
+  return true;
+}
+
+void ArduRoomba::_restartStream()
+{
+  // the whole list again rather than a resume: the OI may have rebooted and lost it
+  byte command[2 + ARDUROOMBA_STREAM_MAX_FIELDS] = {148, (byte)_nbSensorsStream};
+  memcpy(command + 2, _streamIDs, _nbSensorsStream);
+  _send(command, 2 + _nbSensorsStream);
+  _streamPaused = false;
+}
+
+void ArduRoomba::pauseStream()
+{
+  byte command[] = {150, 0};
+  _send(command, sizeof(command));
+  _streamPaused = true;
+  _pausedAt = millis();
+}
+
+void ArduRoomba::resumeStream()
+{
+  byte command[] = {150, 1};
+  _send(command, sizeof(command));
+  _streamPaused = false;
 }
 
 void ArduRoomba::resetStream()
 {
-  Serial.print("ArduRoomba::resetStream\n");
-  _irobot.write(148);
-  _irobot.write(_zero);
+  ARDUROOMBA_DEBUG(F("ArduRoomba::resetStream\n"));
+  _nbSensorsStream = 0;
+  _streamFieldCount = 0;
+  _streamFrameSize = 0;
+  _streamEncoders = false;
+  _drainCount = 0;
+  _streamProfile = NULL;
+  byte command[] = {148, 0};
+  _send(command, sizeof(command));
+}
+
+bool ArduRoomba::poll(RoombaInfos *infos)
+{
+  serviceDrive();
+  _changedSensors.clear();
+  // Stream frames keep being decoded until the stream pauses for a query
+  bool decoded = _queryState != ARDUROOMBA_QUERY_WAIT && _readStream(infos);
+  serviceQuery(infos);
+  if (!decoded) {
+    return false;
+  }
+  infos->lastSuccedRefresh = millis();
+  infos->attempt = 0;
+  return true;
+}
+
+bool ArduRoomba::poll(RoombaInfos *infos, SensorMask *changed)
+{
+  bool decoded = poll(infos);
+  *changed = _changedSensors;
+  return decoded;
+}
+
+bool ArduRoomba::refreshData(RoombaInfos *stateInfos, SensorMask *changed)
+{
+  bool refreshed = refreshData(stateInfos);
+  *changed = _changedSensors;
+  return refreshed;
 }
 
 bool ArduRoomba::refreshData(RoombaInfos *stateInfos) 
 {
   long now = millis();
+  if (poll(stateInfos)) {
+    stateInfos->nextRefresh = now + ARDUROOMBA_REFRESH_DELAY;
+    return true;
+  }
   if (now > stateInfos->nextRefresh) {
     stateInfos->nextRefresh = now + ARDUROOMBA_REFRESH_DELAY;
     stateInfos->attempt++;
-    if (_readStream() &&
-        _parseStreamBuffer(_streamBuffer, _streamBufferCursor, stateInfos)) {
-      stateInfos->lastSuccedRefresh = now;
-      stateInfos->attempt=0;
-      return true;
-    }
-    return false;
   }
   return false;
 }
+
+// Command output
+void ArduRoomba::_send(const byte *command, byte len)
+{
+  if (_txDepth == 0) {
+    _irobot->write(command, len);
+    return;
+  }
+  if (_txLength + len > ARDUROOMBA_TX_BUFFER_SIZE) {
+    _flushCommands();
+  }
+  if (len > ARDUROOMBA_TX_BUFFER_SIZE) {
+    _irobot->write(command, len);
+    return;
+  }
+  memcpy(_txBuffer + _txLength, command, len);
+  _txLength += len;
+}
+
+void ArduRoomba::_flushCommands()
+{
+  if (_txLength > 0) {
+    _irobot->write(_txBuffer, _txLength);
+    _txLength = 0;
+  }
+}
+
+void ArduRoomba::beginCommands()
+{
+  _txDepth++;
+}
+
+void ArduRoomba::endCommands()
+{
+  if (_txDepth == 0) {
+    return;
+  }
+  if (--_txDepth == 0) {
+    _flushCommands();
+  }
+}
+
 // OI commands
+// Shadows of ArduRoomba::_outputsKnown
+#define ARDUROOMBA_OUTPUT_LEDS 0x01
+#define ARDUROOMBA_OUTPUT_SCHEDULING_LEDS 0x02
+#define ARDUROOMBA_OUTPUT_DIGITS 0x04
+
+void ArduRoomba::_sendMode(byte opcode)
+{
+  _sendOpcode(opcode);
+  forgetOutputs();
+}
+
+void ArduRoomba::forgetOutputs()
+{
+  _outputsKnown = 0;
+  _songsLoaded = 0;
+  _driveSent.opcode = 0; // the OI stopped the wheels, the same setpoint has to go out again
+}
+
+bool ArduRoomba::_sendOutput(byte output, byte *shadow, const byte *command, byte len)
+{
+  // command[0] is the opcode, the shadow holds the bytes after it
+  if ((_outputsKnown & output) && memcmp(shadow, command + 1, len - 1) == 0) {
+    return false;
+  }
+  memcpy(shadow, command + 1, len - 1);
+  _outputsKnown |= output;
+  _send(command, len);
+  return true;
+}
+
 void ArduRoomba::start()
 {
-  _irobot.write(128);
+  _sendMode(128);
 }
 
 void ArduRoomba::baud(char baudCode)
 {
-  _irobot.write(129);
-  _irobot.write(baudCode);
+  byte command[] = {129, (byte)baudCode};
+  _send(command, sizeof(command));
+}
+
+static const uint32_t _baudRates[] PROGMEM = {
+    300, 600, 1200, 2400, 4800, 9600, 14400, 19200, 28800, 38400, 57600, 115200};
+
+long ArduRoomba::baudRate(char baudCode)
+{
+  if (baudCode < 0 || baudCode > ARDUROOMBA_BAUD_115200) {
+    return 0;
+  }
+  return pgm_read_dword(&_baudRates[(int)baudCode]);
+}
+
+bool ArduRoomba::_verifyLink()
+{
+  _queryMode();
+
+  unsigned long start = millis();
+  while (!_rxAvailable()) {
+    if (millis() - start > ARDUROOMBA_LINK_CHECK_TIMEOUT) {
+      return false;
+    }
+  }
+  return _rxRead() <= 3; // off, passive, safe or full
+}
+
+bool ArduRoomba::_switchLink(char baudCode, long rate)
+{
+  baud(baudCode);
+  _flushCommands();
+  _irobot->flush(); // the command has to leave at the current rate
+  delay(ARDUROOMBA_BAUD_SETTLE_DELAY);
+  _openLink(rate);
+  _rxClear(); // the end of a frame, or bytes garbled by the switch
+  return _verifyLink();
+}
+
+bool ArduRoomba::setLinkBaud(char baudCode)
+{
+  long rate = baudRate(baudCode);
+  bool ownPort = _hardSerial != NULL;
+#if ARDUROOMBA_SOFTWARESERIAL
+  ownPort = ownPort || _softSerial != NULL;
+#endif
+  if (rate == 0 || !ownPort) {
+    return false;
+  }
+
+  // Stream frames would be mistaken for the mode reply, the settle delay
+  // covers the frame still on its way
+  bool resume = _nbSensorsStream > 0 && !_streamPaused;
+  if (resume) {
+    pauseStream();
+  }
+  long previous = _linkBaud;
+  bool switched = _switchLink(baudCode, rate);
+  if (!switched) {
+    ARDUROOMBA_ERROR(F("ArduRoomba::setLinkBaud error: no reply at the new rate\n"));
+    // the OI may have switched and only the reply was lost: ask it to come
+    // back, at the new rate, then talk at the old one
+    char previousCode = -1;
+    for (char code = 0; code <= ARDUROOMBA_BAUD_115200; code++) {
+      if (baudRate(code) == previous) {
+        previousCode = code;
+      }
+    }
+    if (previousCode < 0 || !_switchLink(previousCode, previous)) {
+      ARDUROOMBA_ERROR(F("ArduRoomba::setLinkBaud error: no reply at the old rate either\n"));
+    }
+  }
+  if (resume) {
+    resumeStream();
+  }
+  return switched;
 }
 
 void ArduRoomba::safe()
 {
-  _irobot.write(131);
+  _sendMode(131);
 }
 
 void ArduRoomba::full()
 {
-  _irobot.write(132);
+  _sendMode(132);
 }
 
 void ArduRoomba::clean()
 {
-  _irobot.write(135);
+  _sendMode(135);
 }
 
 void ArduRoomba::maxClean()
 {
-  _irobot.write(136);
+  _sendMode(136);
 }
 
 void ArduRoomba::spot()
 {
-  _irobot.write(134);
+  _sendMode(134);
 }
 
 void ArduRoomba::seekDock()
 {
-  _irobot.write(143);
+  _sendMode(143);
 }
 
 void ArduRoomba::schedule(ScheduleStore scheduleData)
 {
-  _irobot.write(167);
-  _irobot.write(scheduleData.sunHour);
-  _irobot.write(scheduleData.sunMinute);
-  _irobot.write(scheduleData.monHour);
-  _irobot.write(scheduleData.monMinute);
-  _irobot.write(scheduleData.tueHour);
-  _irobot.write(scheduleData.tueMinute);
-  _irobot.write(scheduleData.wedHour);
-  _irobot.write(scheduleData.wedMinute);
-  _irobot.write(scheduleData.thuHour);
-  _irobot.write(scheduleData.thuMinute);
-  _irobot.write(scheduleData.friHour);
-  _irobot.write(scheduleData.friMinute);
-  _irobot.write(scheduleData.satHour);
-  _irobot.write(scheduleData.satMinute);
+  byte command[] = {167, scheduleData.days,
+                    scheduleData.sunHour, scheduleData.sunMinute,
+                    scheduleData.monHour, scheduleData.monMinute,
+                    scheduleData.tueHour, scheduleData.tueMinute,
+                    scheduleData.wedHour, scheduleData.wedMinute,
+                    scheduleData.thuHour, scheduleData.thuMinute,
+                    scheduleData.friHour, scheduleData.friMinute,
+                    scheduleData.satHour, scheduleData.satMinute};
+  _send(command, sizeof(command));
 }
 
 void ArduRoomba::setDayTime(char day, char hour, char minute)
 {
-  _irobot.write(168);
-  _irobot.write(day);
-  _irobot.write(hour);
-  _irobot.write(minute);
+  byte command[] = {168, (byte)day, (byte)hour, (byte)minute};
+  _send(command, sizeof(command));
 }
 
 void ArduRoomba::power()
 {
-  _irobot.write(133);
+  _sendMode(133);
 }
 
 // Actuator commands
 void ArduRoomba::drive(int velocity, int radius)
 {
-  _irobot.write(137);
-  _irobot.write((velocity >> 8) & 0xFF);
-  _irobot.write(velocity & 0xFF);
-  _irobot.write((radius >> 8) & 0xFF);
-  _irobot.write(radius & 0xFF);
+  _sendDrive(137, velocity, radius);
 }
 
 void ArduRoomba::driveDirect(int rightVelocity, int leftVelocity)
 {
-  _irobot.write(145);
-  _irobot.write((rightVelocity >> 8) & 0xFF);
-  _irobot.write(rightVelocity & 0xFF);
-  _irobot.write((leftVelocity >> 8) & 0xFF);
-  _irobot.write(leftVelocity & 0xFF);
+  _sendDrive(145, rightVelocity, leftVelocity);
 }
 
 void ArduRoomba::drivePWM(int rightPWM, int leftPWM)
 {
-  _irobot.write(146);
-  _irobot.write((rightPWM >> 8) & 0xFF);
-  _irobot.write(rightPWM & 0xFF);
-  _irobot.write((leftPWM >> 8) & 0xFF);
-  _irobot.write(leftPWM & 0xFF);
+  _sendDrive(146, rightPWM, leftPWM);
+}
+
+void ArduRoomba::_sendDrive(byte opcode, int first, int second)
+{
+  byte command[] = {opcode, (byte)(first >> 8), (byte)first, (byte)(second >> 8), (byte)second};
+  _send(command, sizeof(command));
+  _driveSent.opcode = opcode;
+  _driveSent.first = first;
+  _driveSent.second = second;
+}
+
+void ArduRoomba::setDrive(int velocity, int radius)
+{
+  _driveSetpoint.opcode = 137;
+  _driveSetpoint.first = velocity;
+  _driveSetpoint.second = radius;
+  _drivePending = true;
+}
+
+void ArduRoomba::setDriveDirect(int rightVelocity, int leftVelocity)
+{
+  _driveSetpoint.opcode = 145;
+  _driveSetpoint.first = rightVelocity;
+  _driveSetpoint.second = leftVelocity;
+  _drivePending = true;
+}
+
+bool ArduRoomba::serviceDrive()
+{
+  if (!_drivePending) {
+    return false;
+  }
+  unsigned long now = millis();
+  if (now - _driveSentAt < _driveInterval) {
+    return false;
+  }
+  _drivePending = false;
+  if (_driveSetpoint.opcode == _driveSent.opcode && _driveSetpoint.first == _driveSent.first
+      && _driveSetpoint.second == _driveSent.second) {
+    return false;
+  }
+  _sendDrive(_driveSetpoint.opcode, _driveSetpoint.first, _driveSetpoint.second);
+  _driveSentAt = now;
+  return true;
 }
 
 void ArduRoomba::motors(byte data)
 {
-  _irobot.write(138);
-  _irobot.write(data);
+  byte command[] = {138, data};
+  _send(command, sizeof(command));
 }
 
 void ArduRoomba::pwmMotors(char mainBrushPWM, char sideBrushPWM, char vacuumPWM)
 {
-  _irobot.write(144);
-  _irobot.write(mainBrushPWM);
-  _irobot.write(sideBrushPWM);
-  _irobot.write(vacuumPWM);
+  byte command[] = {144, (byte)mainBrushPWM, (byte)sideBrushPWM, (byte)vacuumPWM};
+  _send(command, sizeof(command));
 }
 
 void ArduRoomba::leds(int ledBits, int powerColor, int powerIntensity)
 {
-  _irobot.write(139);
-  _irobot.write(ledBits);
-  _irobot.write(powerColor);
-  _irobot.write(powerIntensity);
+  byte command[] = {139, (byte)ledBits, (byte)powerColor, (byte)powerIntensity};
+  _sendOutput(ARDUROOMBA_OUTPUT_LEDS, _ledState, command, sizeof(command));
 }
 
 void ArduRoomba::schedulingLeds(int weekDayLedBits, int scheduleLedBits)
 {
-  _irobot.write(162);
-  _irobot.write(weekDayLedBits);
-  _irobot.write(scheduleLedBits);
+  byte command[] = {162, (byte)weekDayLedBits, (byte)scheduleLedBits};
+  _sendOutput(ARDUROOMBA_OUTPUT_SCHEDULING_LEDS, _schedulingLedState, command, sizeof(command));
 }
 
 void ArduRoomba::digitLedsRaw(int digitThree, int digitTwo, int digitOne, int digitZero)
 {
-  _irobot.write(163);
-  _irobot.write(digitThree);
-  _irobot.write(digitTwo);
-  _irobot.write(digitOne);
-  _irobot.write(digitZero);
+  byte command[] = {163, (byte)digitThree, (byte)digitTwo, (byte)digitOne, (byte)digitZero};
+  _sendOutput(ARDUROOMBA_OUTPUT_DIGITS, _digitState, command, sizeof(command));
 }
 
-void ArduRoomba::song(Song songData)
+void ArduRoomba::song(const Song &songData)
 {
-  _irobot.write(140);
-  _irobot.write(songData.songNumber);
-  _irobot.write(songData.songLength);
-  for (int i = 0; i < songData.songLength; i++)
+  byte length = songData.songLength > 16 ? 16 : songData.songLength;
+  byte command[3 + 2 * 16] = {140, songData.songNumber, length};
+  for (int i = 0; i < length; i++)
   {
-    _irobot.write(songData.notes[i].noteNumber);
-    _irobot.write(songData.notes[i].noteDuration);
+    command[3 + 2 * i] = songData.notes[i].noteNumber;
+    command[4 + 2 * i] = songData.notes[i].noteDuration;
   }
+
+#if ARDUROOMBA_SONG_CACHE
+  byte slot = songData.songNumber;
+  byte size = 1 + 2 * length; // length and notes, after the opcode and song number
+  if (slot < 5)
+  {
+    if ((_songsLoaded & (1 << slot)) && memcmp(_songState[slot], command + 2, size) == 0)
+    {
+      return; // already in this slot
+    }
+    memcpy(_songState[slot], command + 2, size);
+    _songsLoaded |= 1 << slot;
+  }
+#endif
+  _send(command, 3 + 2 * length);
 }
 
 void ArduRoomba::play(int songNumber)
 {
-  _irobot.write(141);
-  _irobot.write(songNumber);
+  byte command[] = {141, (byte)songNumber};
+  _send(command, sizeof(command));
 }
 
 // Input commands
 void ArduRoomba::sensors(char packetID)
 {
-  // Read the data and print it to the serial console
-  Serial.print("Packet ID: ");
-  Serial.print(packetID, DEC);
-  Serial.print(", Data: ");
-
-  _irobot.write(142);
-  _irobot.write(packetID);
-
-  delay(15);
+  byte id = packetID;
+  queryList(1, &id);
+}
 
-  // Read the data in chunks
-  while (_irobot.available() > 0)
+void ArduRoomba::queryList(byte numPackets, byte *packetIDs)
+{
+  // Wait for the reply, then print it packet by packet to the serial console
+  if (!requestSensors(packetIDs, numPackets)) {
+    return;
+  }
+  byte state = serviceQuery(NULL);
+  while (state == ARDUROOMBA_QUERY_QUIET || state == ARDUROOMBA_QUERY_WAIT) {
+    state = serviceQuery(NULL);
+  }
+  int offset = 0;
+  for (int i = 0; i < numPackets; i++)
   {
-    byte buffer[64];
-    size_t len = _irobot.readBytes(buffer, sizeof(buffer));
-    for (size_t i = 0; i < len; i++)
+    ARDUROOMBA_INFO(F("Packet ID: "));
+    ARDUROOMBA_INFO(packetIDs[i], DEC);
+    ARDUROOMBA_INFO(F(", Data: "));
+    for (int n = 0; n < packetSize(packetIDs[i]) && state == ARDUROOMBA_QUERY_DONE; n++)
     {
-      Serial.print(buffer[i], DEC);
-      Serial.print(" ");
+      ARDUROOMBA_INFO(_rxBuffer[(_rxTail + offset + n) & ARDUROOMBA_RX_MASK], DEC);
+      ARDUROOMBA_INFO(F(" "));
     }
+    offset += packetSize(packetIDs[i]);
+    ARDUROOMBA_INFO(F("\n"));
+  }
+  if (state == ARDUROOMBA_QUERY_DONE) {
+    _rxSkip(_queryLength);
+  } else {
+    ARDUROOMBA_ERROR(F("ArduRoomba::queryList error: no reply\n"));
   }
-  Serial.println();
 }
 
-void ArduRoomba::queryList(byte numPackets, byte *packetIDs)
+unsigned int ArduRoomba::_replyTimeout(int bytes) const
 {
-  _irobot.write(149);
-  _irobot.write(numPackets);
-  for (int i = 0; i < numPackets; i++)
-  {
-    _irobot.write(packetIDs[i]);
+  // 10 bits per byte on the wire
+  return (unsigned long)bytes * 10000UL / _linkBaud + ARDUROOMBA_QUERY_LATENCY;
+}
+
+bool ArduRoomba::requestSensors(const byte *packetIDs, byte count)
+{
+  if (_queryState == ARDUROOMBA_QUERY_QUIET || _queryState == ARDUROOMBA_QUERY_WAIT) {
+    ARDUROOMBA_ERROR(F("ArduRoomba::requestSensors error: a query is pending\n"));
+    return false;
+  }
+  if (count == 0 || count > ARDUROOMBA_QUERY_MAX_PACKETS) {
+    ARDUROOMBA_ERROR(F("ArduRoomba::requestSensors error: 1 to ARDUROOMBA_QUERY_MAX_PACKETS packets per query\n"));
+    return false;
+  }
+  int length = 0;
+  for (int i = 0; i < count; i++) {
+    byte size = packetSize(packetIDs[i]);
+    if (size == 0) {
+      ARDUROOMBA_ERROR(F("ArduRoomba::requestSensors error: unknown packet "));
+      ARDUROOMBA_ERROR(packetIDs[i], DEC);
+      ARDUROOMBA_ERROR(F("\n"));
+      return false;
+    }
+    length += size;
+    _queryIDs[i] = packetIDs[i];
+  }
+  if (length > ARDUROOMBA_STREAM_MAX_SIZE) {
+    ARDUROOMBA_ERROR(F("ArduRoomba::requestSensors error: reply larger than the receive buffer\n"));
+    return false;
   }
+  _queryCount = count;
+  _queryLength = length;
 
-  // Read the data and print it to the serial console
-  for (int i = 0; i < numPackets; i++)
-  {
-    Serial.print("Packet ID: ");
-    Serial.print(packetIDs[i], DEC);
-    Serial.print(", Data: ");
-    while (_irobot.available() > 0)
-    {
-      Serial.print(_irobot.read(), DEC);
-      Serial.print(" ");
+  if (_nbSensorsStream > 0 && !_streamPaused) {
+    // Pause the stream, the reply can't be told apart from frames
+    pauseStream();
+    _flushCommands();
+    _queryResume = true;
+  }
+  unsigned int quiet = ARDUROOMBA_STREAM_SLOT + _replyTimeout(_streamFrameSize + 3);
+  if (_nbSensorsStream > 0 && millis() - _pausedAt < quiet) {
+    // Paused here or just before by the caller: the frame on the wire is
+    // still decoded while waiting for the line to be quiet
+    _queryState = ARDUROOMBA_QUERY_QUIET;
+    _queryAt = _pausedAt;
+    _queryWait = quiet;
+  } else {
+    _sendQuery();
+  }
+  return true;
+}
+
+void ArduRoomba::_sendQuery()
+{
+  _rxClear();
+  if (_queryCount == 1) {
+    byte command[] = {142, _queryIDs[0]};
+    _send(command, sizeof(command));
+  } else {
+    byte command[2 + ARDUROOMBA_QUERY_MAX_PACKETS] = {149, _queryCount};
+    memcpy(command + 2, _queryIDs, _queryCount);
+    _send(command, 2 + _queryCount);
+  }
+  _flushCommands();
+  _queryState = ARDUROOMBA_QUERY_WAIT;
+  _queryAt = millis();
+  _queryWait = _replyTimeout(2 + _queryCount + _queryLength); // the request goes out first
+}
+
+byte ArduRoomba::serviceQuery(RoombaInfos *infos)
+{
+  if (_queryState == ARDUROOMBA_QUERY_QUIET) {
+    if (millis() - _queryAt < _queryWait) {
+      return _queryState;
     }
-    Serial.println();
+    _sendQuery();
+  }
+  if (_queryState != ARDUROOMBA_QUERY_WAIT) {
+    return _queryState;
+  }
+
+  if (_rxAvailable() >= _queryLength) {
+    if (infos) {
+      _storeQueryReply(infos);
+      infos->lastSuccedRefresh = millis();
+    }
+    _queryState = ARDUROOMBA_QUERY_DONE;
+  } else if (millis() - _queryAt > _queryWait) {
+    _rxClear(); // a late reply would be taken for stream bytes
+    _queryState = ARDUROOMBA_QUERY_TIMEOUT;
+  } else {
+    return _queryState;
+  }
+
+  if (_queryResume) {
+    resumeStream();
+    _queryResume = false;
   }
+  return _queryState;
+}
+
+void ArduRoomba::_storeQueryReply(RoombaInfos *infos)
+{
+  // Same values as in a stream frame, without the packet ID bytes
+  byte at = _rxTail;
+  _frameChanges.clear();
+  for (int i = 0; i < _queryCount; i++) {
+    at += _storePacket(_queryIDs[i], at, infos);
+  }
+  _rxSkip(_queryLength);
+  _changedSensors.merge(_frameChanges);
+  _checkModeChange(); // a reply shows a mode change as well as a frame
+}
+
+bool ArduRoomba::querySensors(RoombaInfos *infos, const byte *packetIDs, byte count)
+{
+  if (!requestSensors(packetIDs, count)) {
+    return false;
+  }
+  byte state = serviceQuery(infos);
+  while (state == ARDUROOMBA_QUERY_QUIET || state == ARDUROOMBA_QUERY_WAIT) {
+    state = serviceQuery(infos);
+  }
+  return state == ARDUROOMBA_QUERY_DONE;
 }
 
 // Custom commands
 void ArduRoomba::roombaSetup()
+{
+  ARDUROOMBA_INFO(F("Attempting connection to iRobot OI\n"));
+  beginConnect();
+  byte state = serviceConnect();
+  while (state != ARDUROOMBA_CONNECT_READY && state != ARDUROOMBA_CONNECT_FAILED)
+  {
+    delay(1);
+    state = serviceConnect();
+  }
+
+  if (state == ARDUROOMBA_CONNECT_READY)
+  {
+    ARDUROOMBA_INFO(F("Connection to iRobot OI established\n"));
+  }
+  else
+  {
+    ARDUROOMBA_ERROR(F("ArduRoomba::roombaSetup error: the OI doesn't answer, check the wiring and the battery\n"));
+  }
+}
+
+void ArduRoomba::beginConnect()
 {
   pinMode(_brcPin, OUTPUT);
   digitalWrite(_brcPin, HIGH); // Ensure it starts HIGH
-  delay(2000);                 // Wait 2 seconds after power on
-  for (int i = 0; i < 3; i++)
-  {                              // Pulse the BRC pin low three times
-    digitalWrite(_brcPin, LOW);  // Bring BRC pin LOW
-    delay(100);                  // Wait 100ms
-    digitalWrite(_brcPin, HIGH); // Bring BRC pin back HIGH
-    delay(100);                  // Wait 100ms before next pulse
-  }
-  Serial.println("Attempting connection to iRobot OI");
-  delay(150);
-  _irobot.begin(19200);
-
-  Serial.println("Sending Start to OI");
-  delay(150);
+  _openLink(ARDUROOMBA_DEFAULT_BAUD);
+
+  // An OI that is already awake answers right away and the wake up is
+  // skipped. After an MCU only reset it may still stream, its bytes would be
+  // read as the mode: stop the stream and let the frame on the wire end
+  // before the query.
   start();
+  _connectResume = _nbSensorsStream > 0 && !_streamPaused; // restarted once READY
+  pauseStream();
+  _flushCommands();
+  _connectStep = 0;
+  _connectQuery = false;
+  _connectNext(ARDUROOMBA_CONNECT_PROBE, ARDUROOMBA_STREAM_SLOT + _replyTimeout(ARDUROOMBA_STREAM_MAX_SIZE + 3));
+}
 
-  Serial.println("Sending Safe to OI");
-  delay(150);
-  safe();
+void ArduRoomba::_queryMode()
+{
+  _rxClear();
+  byte command[] = {142, ARDUROOMBA_SENSOR_MODE};
+  _send(command, sizeof(command));
+  _flushCommands();
+}
 
-  Serial.println("Connection to iRobot OI SHOULD BE established");
-  Serial.println("Verify if CLEAN light has stopped illuminating");
-  delay(150);
+void ArduRoomba::_connectNext(byte state, unsigned int wait)
+{
+  _connectState = state;
+  _connectAt = millis();
+  _connectWait = wait;
+}
+
+byte ArduRoomba::serviceConnect()
+{
+  bool elapsed = millis() - _connectAt >= _connectWait;
+  switch (_connectState)
+  {
+  case ARDUROOMBA_CONNECT_PROBE:
+    if (!_connectQuery) {
+      if (elapsed) {
+        _queryMode(); // clears what the stream left in the ring
+        _connectQuery = true;
+        _connectNext(ARDUROOMBA_CONNECT_PROBE, ARDUROOMBA_LINK_CHECK_TIMEOUT);
+      }
+    } else if (_rxAvailable() > 0 && _rxRead() <= 3) {
+      _connectNext(ARDUROOMBA_CONNECT_SAFE, 0);
+    } else if (elapsed) {
+      // Power on wait counted from the probe query
+      _connectState = ARDUROOMBA_CONNECT_POWER_WAIT;
+      _connectWait = ARDUROOMBA_POWER_ON_DELAY;
+    }
+    break;
+  case ARDUROOMBA_CONNECT_POWER_WAIT:
+    if (elapsed) {
+      digitalWrite(_brcPin, LOW);
+      _connectNext(ARDUROOMBA_CONNECT_BRC_LOW, ARDUROOMBA_BRC_PULSE);
+    }
+    break;
+  case ARDUROOMBA_CONNECT_BRC_LOW:
+    if (elapsed) {
+      digitalWrite(_brcPin, HIGH);
+      _connectStep++;
+      _connectNext(ARDUROOMBA_CONNECT_BRC_HIGH, ARDUROOMBA_BRC_PULSE);
+    }
+    break;
+  case ARDUROOMBA_CONNECT_BRC_HIGH:
+    if (!elapsed) {
+      break;
+    }
+    if (_connectStep < 3) { // Pulse the BRC pin low three times
+      digitalWrite(_brcPin, LOW);
+      _connectNext(ARDUROOMBA_CONNECT_BRC_LOW, ARDUROOMBA_BRC_PULSE);
+    } else {
+      _connectStep = 0;
+      _connectNext(ARDUROOMBA_CONNECT_START, ARDUROOMBA_COMMAND_DELAY);
+    }
+    break;
+  case ARDUROOMBA_CONNECT_START:
+    if (elapsed) {
+      start();
+      _connectNext(ARDUROOMBA_CONNECT_SAFE, ARDUROOMBA_COMMAND_DELAY);
+    }
+    break;
+  case ARDUROOMBA_CONNECT_SAFE:
+    if (elapsed) {
+      safe();
+      _connectQuery = false;
+      _connectNext(ARDUROOMBA_CONNECT_VERIFY, ARDUROOMBA_COMMAND_DELAY);
+    }
+    break;
+  case ARDUROOMBA_CONNECT_VERIFY:
+    if (_connectQuery && _rxAvailable() > 0) {
+      int mode = _rxRead();
+      _connectQuery = false;
+      if (mode == 2 || mode == 3) {
+        _connectState = ARDUROOMBA_CONNECT_READY;
+        if (_connectResume) {
+          _restartStream();
+          _connectResume = false;
+        }
+        break;
+      }
+      _connectStep++; // still passive, safe() was rejected or lost
+      _connectNext(_connectStep < ARDUROOMBA_CONNECT_ATTEMPTS ? ARDUROOMBA_CONNECT_SAFE : ARDUROOMBA_CONNECT_FAILED, 0);
+    } else if (elapsed) {
+      if (_connectQuery && ++_connectStep >= ARDUROOMBA_CONNECT_ATTEMPTS) {
+        _connectState = ARDUROOMBA_CONNECT_FAILED;
+        break;
+      }
+      _queryMode();
+      _connectQuery = true;
+      _connectNext(ARDUROOMBA_CONNECT_VERIFY, ARDUROOMBA_LINK_CHECK_TIMEOUT);
+    }
+    break;
+  }
+  return _connectState;
 }
 
 void ArduRoomba::goForward()
 {
-  _irobot.write(137);   // Opcode for Drive
-  _irobot.write(0x01);  // High byte for 500 mm/s
-  _irobot.write(0xF4);  // Low byte for 500 mm/s
-  _irobot.write(0x80);  // High byte for radius (straight)
-  _irobot.write(_zero); // Low byte for radius (straight)
+  _sendDrive(137, 500, ARDUROOMBA_RADIUS_STRAIGHT);
 }
 
 void ArduRoomba::goBackward()
 {
-  _irobot.write(137);   // Opcode for Drive
-  _irobot.write(0xFE);  // High byte for -500 mm/s
-  _irobot.write(0x0C);  // Low byte for -500 mm/s
-  _irobot.write(0x80);  // High byte for radius (straight)
-  _irobot.write(_zero); // Low byte for radius (straight)
+  _sendDrive(137, -500, ARDUROOMBA_RADIUS_STRAIGHT);
 }
 
 void ArduRoomba::turnLeft()
 {
-  // Drive command [137], velocity 200 mm/s, radius 1 (turn in place counterclockwise)
-  _irobot.write(137);   // Opcode for Drive
-  _irobot.write(_zero); // Velocity high byte (200 mm/s)
-  _irobot.write(0xC8);  // Velocity low byte (200 mm/s)
-  _irobot.write(_zero); // Radius high byte (1)
-  _irobot.write(0x01);  // Radius low byte (1)
+  _sendDrive(137, 200, 1); // 200 mm/s, radius 1 turns in place counterclockwise
 }
 
 void ArduRoomba::turnRight()
 {
-  // Drive command [137], velocity 200 mm/s, radius -1 (turn in place clockwise)
-  _irobot.write(137);   // Opcode for Drive
-  _irobot.write(_zero); // Velocity high byte (200 mm/s)
-  _irobot.write(0xC8);  // Velocity low byte (200 mm/s)
-  _irobot.write(0xFF);  // Radius high byte (-1)
-  _irobot.write(0xFF);  // Radius low byte (-1)
+  _sendDrive(137, 200, -1); // 200 mm/s, radius -1 turns in place clockwise
 }
 
 void ArduRoomba::halt()
 {
-  _irobot.write(137);
-  _irobot.write(_zero);
-  _irobot.write(_zero);
-  _irobot.write(_zero);
-  _irobot.write(_zero);
+  _sendDrive(137, 0, 0);
 }
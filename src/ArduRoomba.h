@@ -2,7 +2,62 @@
 #define ArduRoomba_h
 
 #include <Arduino.h>
+
+// Set to 0 to build without SoftwareSerial, the OI link then has to be a
+// HardwareSerial or a Stream given to the constructor
+#ifndef ARDUROOMBA_SOFTWARESERIAL
+#define ARDUROOMBA_SOFTWARESERIAL 1
+#endif
+
+#if ARDUROOMBA_SOFTWARESERIAL
 #include <SoftwareSerial.h>
+#endif
+
+// Messages printed by the library: 0 none, 1 errors, 2 errors and the
+// output of sensors(), queryList() and roombaSetup(), 3 everything. Below a
+// level the messages are not compiled in. The level has to be set for the
+// whole build (compiler flags), a #define in the sketch doesn't reach the library.
+#define ARDUROOMBA_LOG_NONE 0
+#define ARDUROOMBA_LOG_ERRORS 1
+#define ARDUROOMBA_LOG_INFO 2
+#define ARDUROOMBA_LOG_DEBUG 3
+#ifndef ARDUROOMBA_LOG_LEVEL
+#define ARDUROOMBA_LOG_LEVEL ARDUROOMBA_LOG_INFO
+#endif
+
+#define ARDUROOMBA_DEFAULT_BAUD 19200 // OI baud rate after the BRC pulses
+#define ARDUROOMBA_BAUD_SETTLE_DELAY 100 // wait after a baud change before talking at the new rate
+#define ARDUROOMBA_LINK_CHECK_TIMEOUT 50 // wait for the reply that validates the link
+#define ARDUROOMBA_POWER_ON_DELAY 2000 // wait after power on before the BRC pulses
+#define ARDUROOMBA_BRC_PULSE 100 // length of a BRC pulse and of the gap between two
+#define ARDUROOMBA_COMMAND_DELAY 150 // wait between the setup commands
+#define ARDUROOMBA_CONNECT_ATTEMPTS 3 // mode queries before the connection is given up
+
+// Connection states, see beginConnect()
+#define ARDUROOMBA_CONNECT_IDLE 0
+#define ARDUROOMBA_CONNECT_PROBE 1 // the OI may still be awake, after an MCU reset
+#define ARDUROOMBA_CONNECT_POWER_WAIT 2
+#define ARDUROOMBA_CONNECT_BRC_LOW 3
+#define ARDUROOMBA_CONNECT_BRC_HIGH 4
+#define ARDUROOMBA_CONNECT_START 5
+#define ARDUROOMBA_CONNECT_SAFE 6
+#define ARDUROOMBA_CONNECT_VERIFY 7 // waiting for the mode packet
+#define ARDUROOMBA_CONNECT_READY 8  // the OI answered in Safe or Full mode
+#define ARDUROOMBA_CONNECT_FAILED 9
+
+// OI baud codes, see baud() and setLinkBaud()
+#define ARDUROOMBA_BAUD_300 0
+#define ARDUROOMBA_BAUD_600 1
+#define ARDUROOMBA_BAUD_1200 2
+#define ARDUROOMBA_BAUD_2400 3
+#define ARDUROOMBA_BAUD_4800 4
+#define ARDUROOMBA_BAUD_9600 5
+#define ARDUROOMBA_BAUD_14400 6
+#define ARDUROOMBA_BAUD_19200 7
+#define ARDUROOMBA_BAUD_28800 8
+#define ARDUROOMBA_BAUD_38400 9
+#define ARDUROOMBA_BAUD_57600 10
+#define ARDUROOMBA_BAUD_115200 11
 
 #define ARDUROOMBA_REFRESH_DELAY 40
 #define ARDUROOMBA_STREAM_TIMEOUT 16 // stream time slot = 15ms
@@ -13,6 +68,55 @@
 #define ARDUROOMBA_STREAM_WAIT_CHECKSUM 3
 #define ARDUROOMBA_STREAM_END 4
 
+#define ARDUROOMBA_STREAM_HEADER 19
+
+// Receive ring, a power of two up to 256 bytes that holds a whole frame
+#ifndef ARDUROOMBA_RX_BUFFER_SIZE
+#if defined(__AVR__)
+#define ARDUROOMBA_RX_BUFFER_SIZE 128
+#else
+#define ARDUROOMBA_RX_BUFFER_SIZE 256
+#endif
+#endif
+#define ARDUROOMBA_RX_MASK (ARDUROOMBA_RX_BUFFER_SIZE - 1)
+#define ARDUROOMBA_STREAM_MAX_SIZE (ARDUROOMBA_RX_BUFFER_SIZE - 4) // content bytes of the largest frame
+#define ARDUROOMBA_RECORD_HEADER 2 // ms since the previous recorded frame, low byte first, then the raw frame
+#ifndef ARDUROOMBA_STREAM_MAX_FIELDS
+#if defined(__AVR__)
+#define ARDUROOMBA_STREAM_MAX_FIELDS 20 // sensors per stream frame, enough for a full slot at 19200 baud
+#else
+#define ARDUROOMBA_STREAM_MAX_FIELDS 52 // sensors per stream frame, enough for group 100
+#endif
+#endif
+#define ARDUROOMBA_STREAM_SLOT 15 // ms between two stream frames
+
+// Sensor queries, see requestSensors()
+#define ARDUROOMBA_QUERY_MAX_PACKETS 8 // packets of one query
+#define ARDUROOMBA_QUERY_LATENCY 5 // ms the OI may take to answer, on top of the transfer time
+#define ARDUROOMBA_QUERY_IDLE 0
+#define ARDUROOMBA_QUERY_QUIET 1 // waiting for the paused stream to stop
+#define ARDUROOMBA_QUERY_WAIT 2  // waiting for the reply
+#define ARDUROOMBA_QUERY_DONE 3
+#define ARDUROOMBA_QUERY_TIMEOUT 4
+
+// Commands queued between beginCommands() and endCommands(), a full buffer is
+// sent early. A single command longer than the buffer (a song) goes out alone.
+#ifndef ARDUROOMBA_TX_BUFFER_SIZE
+#define ARDUROOMBA_TX_BUFFER_SIZE 32
+#endif
+
+// Drive setpoints, sent by serviceDrive() at most once per interval
+#ifndef ARDUROOMBA_DRIVE_INTERVAL
+#define ARDUROOMBA_DRIVE_INTERVAL 20 // ms between two drive setpoint updates
+#endif
+#define ARDUROOMBA_RADIUS_STRAIGHT -32768 // drive() radius for a straight line
+
+// song() keeps a copy of the 5 song slots, 33 bytes each, to skip uploading
+// a song already loaded. Set to 0 to save the RAM, every song() is sent.
+#ifndef ARDUROOMBA_SONG_CACHE
+#define ARDUROOMBA_SONG_CACHE 1
+#endif
+
 
 #define ARDUROOMBA_SENSOR_BUMPANDWEELSDROPS 7
 #define ARDUROOMBA_SENSOR_WALL 8
@@ -25,6 +129,8 @@
 #define ARDUROOMBA_SENSOR_DIRTDETECT 15
 #define ARDUROOMBA_SENSOR_IROPCODE 17
 #define ARDUROOMBA_SENSOR_BUTTONS 18
+#define ARDUROOMBA_SENSOR_DISTANCE 19
+#define ARDUROOMBA_SENSOR_ANGLE 20
 #define ARDUROOMBA_SENSOR_CHARGINGSTATE 21
 #define ARDUROOMBA_SENSOR_VOLTAGE 22
 #define ARDUROOMBA_SENSOR_CURRENT 23
@@ -62,11 +168,111 @@
 #define ARDUROOMBA_SENSOR_SIDEBRUSHMOTORCURRENT 57
 #define ARDUROOMBA_SENSOR_STASIS 58
 
+// Group packets, each one carries a fixed range of the packets above
+#define ARDUROOMBA_SENSOR_GROUP_7_26 0
+#define ARDUROOMBA_SENSOR_GROUP_7_16 1
+#define ARDUROOMBA_SENSOR_GROUP_17_20 2
+#define ARDUROOMBA_SENSOR_GROUP_21_26 3
+#define ARDUROOMBA_SENSOR_GROUP_27_34 4
+#define ARDUROOMBA_SENSOR_GROUP_35_42 5
+#define ARDUROOMBA_SENSOR_GROUP_7_42 6
+#define ARDUROOMBA_SENSOR_GROUP_7_58 100
+#define ARDUROOMBA_SENSOR_GROUP_43_58 101
+#define ARDUROOMBA_SENSOR_GROUP_46_51 106
+#define ARDUROOMBA_SENSOR_GROUP_54_58 107
+
+// Packet meta formats, see packetMeta()
+#define ARDUROOMBA_FIELD_BYTE 0x00
+#define ARDUROOMBA_FIELD_GROUP 0x08  // group packet, its packets follow without ID bytes
+#define ARDUROOMBA_FIELD_NODATA 0x10 // ID byte of a group packet or unused packet, nothing to store
+#define ARDUROOMBA_FIELD_TAGGED 0x20 // the packet ID byte comes just before the value
+#define ARDUROOMBA_FIELD_SIGNED 0x40
+#define ARDUROOMBA_FIELD_WIDE 0x80 // two bytes on the wire (high byte first)
+
+// Packet IDs of the OI spec, same values as the ARDUROOMBA_SENSOR_* defines
+enum class RoombaPacket : uint8_t
+{
+  Group7_26 = 0,
+  Group7_16 = 1,
+  Group17_20 = 2,
+  Group21_26 = 3,
+  Group27_34 = 4,
+  Group35_42 = 5,
+  Group7_42 = 6,
+  BumpsAndWheelDrops = 7,
+  Wall = 8,
+  CliffLeft = 9,
+  CliffFrontLeft = 10,
+  CliffFrontRight = 11,
+  CliffRight = 12,
+  VirtualWall = 13,
+  WheelOvercurrents = 14,
+  DirtDetect = 15,
+  Unused16 = 16,
+  InfraredCharacterOmni = 17,
+  Buttons = 18,
+  Distance = 19,
+  Angle = 20,
+  ChargingState = 21,
+  Voltage = 22,
+  Current = 23,
+  Temperature = 24,
+  BatteryCharge = 25,
+  BatteryCapacity = 26,
+  WallSignal = 27,
+  CliffLeftSignal = 28,
+  CliffFrontLeftSignal = 29,
+  CliffFrontRightSignal = 30,
+  CliffRightSignal = 31,
+  Unused32 = 32,
+  Unused33 = 33,
+  ChargingSourcesAvailable = 34,
+  OIMode = 35,
+  SongNumber = 36,
+  SongPlaying = 37,
+  NumberOfStreamPackets = 38,
+  RequestedVelocity = 39,
+  RequestedRadius = 40,
+  RequestedRightVelocity = 41,
+  RequestedLeftVelocity = 42,
+  LeftEncoderCounts = 43,
+  RightEncoderCounts = 44,
+  LightBumper = 45,
+  LightBumpLeftSignal = 46,
+  LightBumpFrontLeftSignal = 47,
+  LightBumpCenterLeftSignal = 48,
+  LightBumpCenterRightSignal = 49,
+  LightBumpFrontRightSignal = 50,
+  LightBumpRightSignal = 51,
+  InfraredCharacterLeft = 52,
+  InfraredCharacterRight = 53,
+  LeftMotorCurrent = 54,
+  RightMotorCurrent = 55,
+  MainBrushMotorCurrent = 56,
+  SideBrushMotorCurrent = 57,
+  Stasis = 58,
+  Group7_58 = 100,
+  Group43_58 = 101,
+  Group46_51 = 106,
+  Group54_58 = 107,
+};
+
+class ArduRoombaOdometry;
+
 class ArduRoomba
 {
 public:
-  // Constructor
-  ArduRoomba(int rxPin, int txPin, int brcPin); // Constructor
+  // Constructors
+#if ARDUROOMBA_SOFTWARESERIAL
+  ArduRoomba(int rxPin, int txPin, int brcPin);   // SoftwareSerial link on rxPin/txPin
+#endif
+  ArduRoomba(HardwareSerial &serial, int brcPin); // hardware UART, opened by roombaSetup()
+  ArduRoomba(Stream &stream, int brcPin);         // any other Stream, opened by the caller
+#if ARDUROOMBA_SOFTWARESERIAL
+  ~ArduRoomba();
+#endif
+  ArduRoomba(const ArduRoomba &) = delete; // owns its port and receive ring
+  ArduRoomba &operator=(const ArduRoomba &) = delete;
 
   // Custom structs to use in main code.
   struct Note
@@ -82,11 +288,43 @@ public:
     Note notes[16];  // Array of notes, up to 16
   };
 
+  // Sensor snapshot, packets are kept as the OI sends them: bitfield packets
+  // stay one byte and are read through the accessors below.
   struct RoombaInfos {
     long nextRefresh;       // time of next update
-    long lastSuccedRefresh; // time of last successfull update
+    long lastSuccedRefresh; // time of last successfull update, stream frame or query reply
     int  attempt;           // number of failed attempts since last success
 
+    uint16_t voltage;            // mV
+    int16_t current;             // mA
+    uint16_t batteryCharge;      // mAh
+    uint16_t batteryCapacity;    // mAh
+    int16_t velocity;            // mm/s
+    int16_t radius;              // mm
+    int16_t rightVelocity;       // mm/s
+    int16_t leftVelocity;        // mm/s
+    int16_t distance;            // mm since the previous request
+    int16_t angle;               // degrees since the previous request
+    uint16_t leftEncoderCounts;  // wraps around
+    uint16_t rightEncoderCounts; // wraps around
+    int16_t leftMotorCurrent;    // mA
+    int16_t rightMotorCurrent;
+    int16_t mainBrushMotorCurrent;
+    int16_t sideBrushMotorCurrent;
+
+    // analog signals, contiguous in OI packet order
+    uint16_t wallSignal;
+    uint16_t cliffLeftSignal;
+    uint16_t cliffFrontLeftSignal;
+    uint16_t cliffFrontRightSignal;
+    uint16_t cliffRightSignal;
+    uint16_t lightBumpLeftSignal;
+    uint16_t lightBumpFrontLeftSignal;
+    uint16_t lightBumpCenterLeftSignal;
+    uint16_t lightBumpCenterRightSignal;
+    uint16_t lightBumpFrontRightSignal;
+    uint16_t lightBumpRightSignal;
+
     byte irOpcode;
     byte songNumber;
     byte ioStreamNumPackets;
@@ -94,86 +332,98 @@ public:
     byte chargingState;
     byte infraredCharacterLeft;
     byte infraredCharacterRight;
-    char temperature;
-    
-    int voltage;
-    int current;
-    
-    int batteryCapacity;
-    int batteryCharge;
-    int dirtdetect;
-    int velocity;
-    int rightVelocity;
-    int leftVelocity;
-    int radius;
-    int leftEncoderCounts;
-    int rightEncoderCounts;
-    int leftMotorCurrent;
-    int rightMotorCurrent;
-    int mainBrushMotorCurrent;
-    int sideBrushMotorCurrent;
-
-    unsigned int wallSignal;
-    unsigned int cliffLeftSignal;
-    unsigned int cliffFrontLeftSignal;
-    unsigned int cliffRightSignal;
-    unsigned int cliffFrontRightSignal;
-    unsigned int lightBumpLeftSignal;
-    unsigned int lightBumpFrontLeftSignal;
-    unsigned int lightBumpCenterLeftSignal;
-    unsigned int lightBumpCenterRightSignal;
-    unsigned int lightBumpFrontRightSignal;
-    unsigned int lightBumpRightSignal;
-
-    bool wall;
-    bool virtualWall;
-    bool cliffLeft;
-    bool cliffFrontLeft;
-    bool cliffRight;
-    bool cliffFrontRight;
-    bool songPlaying;
-
-
-    //ARDUROOMBA_SENSOR_LIGHTBUMPER
-    bool lightBumperLeft;
-    bool lightBumperFrontLeft;
-    bool lightBumperCenterLeft;
-    bool lightBumperCenterRight;
-    bool lightBumperFrontRight;
-    bool lightBumperRight;
-  
-    // ARDUROOMBA_SENSOR_CHARGERAVAILABLE
-    bool internalChargerAvailable;
-    bool homeBaseChargerAvailable;
-
-    // ARDUROOMBA_SENSOR_STASIS
-    bool stasisDisabled;
-    bool stasisToggling;
-
-    // ARDUROOMBA_SENSOR_BUTTONS
-    bool cleanButton;
-    bool spotButton;
-    bool dockButton;
-    bool minuteButton;
-    bool hourButton;
-    bool dayButton;
-    bool scheludeButton;
-    bool clockButton;
-
-    // ARDUROOMBA_SENSOR_WHEELOVERCURRENTS
-    bool wheelRightOvercurrent;
-    bool wheelLeftOvercurrent;
-    bool mainBrushOvercurrent;
-    bool sideBrushOvercurrent;
-    bool vacuumOvercurrent;       // no wacuum for serie 600
-
-    // ARDUROOMBA_SENSOR_WHEELOVERCURRENTS
-    bool bumpRight;
-    bool bumpLeft;
-    bool wheelDropRight;
-    bool wheelDropLeft;
+    byte dirtdetect;
+    int8_t temperature; // degrees Celsius
+
+    byte wall;
+    byte virtualWall;
+    byte cliffLeft;
+    byte cliffFrontLeft;
+    byte cliffFrontRight;
+    byte cliffRight;
+    byte songPlaying;
+
+    byte bumpsAndWheelDrops; // ARDUROOMBA_SENSOR_BUMPANDWEELSDROPS
+    byte wheelOvercurrents;  // ARDUROOMBA_SENSOR_WHEELOVERCURRENTS
+    byte buttons;            // ARDUROOMBA_SENSOR_BUTTONS
+    byte lightBumper;        // ARDUROOMBA_SENSOR_LIGHTBUMPER
+    byte chargersAvailable;  // ARDUROOMBA_SENSOR_CHARGERAVAILABLE
+    byte stasis;             // ARDUROOMBA_SENSOR_STASIS
+
+    bool bumpRight() const { return bumpsAndWheelDrops & 0x01; }
+    bool bumpLeft() const { return bumpsAndWheelDrops & 0x02; }
+    bool wheelDropRight() const { return bumpsAndWheelDrops & 0x04; }
+    bool wheelDropLeft() const { return bumpsAndWheelDrops & 0x08; }
+
+    bool sideBrushOvercurrent() const { return wheelOvercurrents & 0x01; }
+    bool vacuumOvercurrent() const { return wheelOvercurrents & 0x02; } // no wacuum for serie 600
+    bool mainBrushOvercurrent() const { return wheelOvercurrents & 0x04; }
+    bool wheelRightOvercurrent() const { return wheelOvercurrents & 0x08; }
+    bool wheelLeftOvercurrent() const { return wheelOvercurrents & 0x10; }
+
+    bool cleanButton() const { return buttons & 0x01; }
+    bool spotButton() const { return buttons & 0x02; }
+    bool dockButton() const { return buttons & 0x04; }
+    bool minuteButton() const { return buttons & 0x08; }
+    bool hourButton() const { return buttons & 0x10; }
+    bool dayButton() const { return buttons & 0x20; }
+    bool scheludeButton() const { return buttons & 0x40; }
+    bool clockButton() const { return buttons & 0x80; }
+
+    bool lightBumperLeft() const { return lightBumper & 0x01; }
+    bool lightBumperFrontLeft() const { return lightBumper & 0x02; }
+    bool lightBumperCenterLeft() const { return lightBumper & 0x04; }
+    bool lightBumperCenterRight() const { return lightBumper & 0x08; }
+    bool lightBumperFrontRight() const { return lightBumper & 0x10; }
+    bool lightBumperRight() const { return lightBumper & 0x20; }
+
+    bool internalChargerAvailable() const { return chargersAvailable & 0x01; }
+    bool homeBaseChargerAvailable() const { return chargersAvailable & 0x02; }
+
+    bool stasisToggling() const { return stasis & 0x01; }
+    bool stasisDisabled() const { return stasis & 0x02; }
+
+    bool sameSensors(const RoombaInfos &other) const; // compare sensor values, ignoring the refresh bookkeeping
   };
 
+  // Set of sensor packet IDs (0 - 63), one bit each
+  struct SensorMask
+  {
+    byte bits[8];
+
+    void clear() { memset(bits, 0, sizeof(bits)); }
+    void set(byte packetID) { bits[packetID >> 3] |= 1 << (packetID & 7); }
+    bool has(byte packetID) const { return packetID < 64 && (bits[packetID >> 3] & (1 << (packetID & 7))); }
+    bool any() const;
+    int next(int packetID) const; // next ID in the set after packetID (start with -1), -1 at the end
+    void merge(const SensorMask &other);
+  };
+
+  // Link health, counted by the stream decoder. Times are in microseconds.
+  struct LinkStats
+  {
+    unsigned long framesOk;
+    unsigned long bytesDiscarded;    // bytes skipped while looking for a frame header
+    unsigned int checksumErrors;
+    unsigned int lengthMismatches;   // headers followed by a size that isn't the requested frame's
+    unsigned int unknownPackets;     // right size, but packet IDs that weren't requested
+    unsigned int resyncs;            // headers rejected, the scan restarted after them
+    unsigned int rxOverruns;         // bytes dropped by the receive ring, plus port overflows seen by receive()
+    unsigned int decodeMin, decodeMax; // time to decode and store a frame
+    unsigned long decodeTotal;
+    unsigned long gapMin, gapMax;    // time between two decoded frames
+    unsigned long gapTotal;
+
+    unsigned int decodeAverage() const { return framesOk ? decodeTotal / framesOk : 0; }
+    unsigned long gapAverage() const { return framesOk > 1 ? gapTotal / (framesOk - 1) : 0; }
+  };
+
+  // Called for every decoded stream frame, with the packets whose value changed
+  typedef void (*FrameHandler)(const RoombaInfos &infos, const SensorMask &changed);
+
+  // Called on a safety sensor transition, with the raw packet value before and after
+  typedef void (*SensorHandler)(byte packetID, byte previous, byte current);
+
   struct ScheduleStore
   {
     byte days;
@@ -206,6 +456,18 @@ public:
   void setDayTime(char day, char hour, char minute); // Set the day and time
   void power();                                      // Power down the OI
 
+  // Switch the OI and the local port to a new rate, back to the old one if
+  // the link is lost. A running stream is paused meanwhile.
+  bool setLinkBaud(char baudCode);
+  long linkBaud() const { return _linkBaud; } // current link rate, in baud
+  void setLinkRate(long baud) { if (baud > 0) _linkBaud = baud; } // rate the sketch opened its Stream at, nothing is sent
+#if ARDUROOMBA_SOFTWARESERIAL
+  bool softwareSerialLink() const { return _softSerial != NULL; } // only one SoftwareSerial port listens at a time
+#else
+  bool softwareSerialLink() const { return false; }
+#endif
+  static long baudRate(char baudCode); // rate of an OI baud code, 0 if unknown
+
   // Actuator commands
   void drive(int velocity, int radius);                                         // Drive the robot
   void driveDirect(int rightVelocity, int leftVelocity);                        // Drive the robot directly
@@ -215,41 +477,281 @@ public:
   void leds(int ledBits, int powerColor, int powerIntensity);                   // Control the LEDs
   void schedulingLeds(int weekDayLedBits, int scheduleLedBits);                 // Control the scheduling LEDs
   void digitLedsRaw(int digitThree, int digitTwo, int digitOne, int digitZero); // Control the digit LEDs
-  void song(Song songData);                                                     // Load a song
+  void song(const Song &songData);                                              // Load a song
   void play(int songNumber);                                                    // Play a song
 
+  // The last LED, digit and song state written is kept, an identical update
+  // doesn't go on the link. Songs are compared note by note with a copy of
+  // each slot (see ARDUROOMBA_SONG_CACHE). The state is forgotten when the OI mode changes (start(), safe(),
+  // full()..., or packet 35 changing in a frame or a query reply), since the robot resets it.
+  bool songLoaded(byte songNumber) const { return songNumber < 5 && (_songsLoaded & (1 << songNumber)); }
+  void forgetOutputs(); // send everything again, drive setpoint included, after raw commands or a robot reset
+
+  // Drive setpoints, only the latest one is kept. serviceDrive() sends it at
+  // most once per interval and only when it differs from the last drive
+  // command sent, poll() and refreshData() call it.
+  void setDrive(int velocity, int radius);               // setpoint for drive()
+  void setDriveDirect(int rightVelocity, int leftVelocity); // setpoint for driveDirect()
+  void setDriveInterval(unsigned int interval) { _driveInterval = interval; } // ms
+  bool serviceDrive(); // true if the setpoint was sent
+
   // Input commands
-  void sensors(char packetID);                      // Request a sensor packet
-  void queryList(byte numPackets, byte *packetIDs); // Request a list of sensor packets
+  void sensors(char packetID);                      // Request a sensor packet and print the reply
+  void queryList(byte numPackets, byte *packetIDs); // Request a list of sensor packets and print the reply
 
-  void queryStream(char sensorlist[]);              // Request a list of sensor packets to stream
+  // Sensor queries decode the reply into RoombaInfos like a stream frame and
+  // wait only for the transfer time of the reply. A running stream is paused
+  // during the query and resumed after it.
+  bool querySensor(RoombaInfos *infos, byte packetID) { return querySensors(infos, &packetID, 1); }
+  bool querySensors(RoombaInfos *infos, const byte *packetIDs, byte count); // blocks, true if the reply was decoded
+  bool requestSensors(const byte *packetIDs, byte count); // same without blocking, poll() or serviceQuery() decodes the reply
+  byte serviceQuery(RoombaInfos *infos); // advance the pending query, returns ARDUROOMBA_QUERY_*
+  byte queryState() const { return _queryState; }
+
+  bool queryStream(char sensorlist[]);              // Request a list of sensor packets to stream
+  bool queryStream(const char *sensorlist, byte count); // Same with an explicit length, allows group 0
+
+  // Spec entry of a packet, read from a PROGMEM table
+  struct PacketMeta
+  {
+    byte size;      // data bytes on the wire, without the ID byte
+    byte format;    // ARDUROOMBA_FIELD_* flags
+    byte dest;      // offset of the field in RoombaInfos, first packet of a group
+    byte last;      // last packet of a group
+    int16_t minimum; // value range given by the spec
+    uint16_t maximum;
+  };
+  static bool packetMeta(byte packetID, PacketMeta *meta);    // false for unknown packets
+  static bool packetMeta(RoombaPacket packet, PacketMeta *meta) { return packetMeta((byte)packet, meta); }
+
+  // Stream planning, sensor lists are zero terminated
+  static byte packetSize(byte packetID);                       // data bytes of a packet, 0 if unknown
+  static bool sensorLocation(byte packetID, byte *offset, bool *wide, bool *isSigned); // field of a packet in RoombaInfos, false for groups and unknown packets
+  static int streamFrameBytes(const char *sensorlist);         // bytes of one stream frame on the wire, -1 if a packet is unknown
+  int streamSlotBytes() const;                                 // bytes the link carries in one stream slot
+  int planStream(const char *sensorlist) const;                // number of leading packets of the list that fit in a slot
+  int suggestStreamGroup(const char *sensorlist) const;        // group packet carrying the whole list in fewer bytes, -1 if none
   void resetStream();                               // Request an empty list of sensor packets to stream
+  void pauseStream();                               // Stop the stream, the list is kept
+  void resumeStream();                              // Restart the stream with the same list
+  bool streamPaused() const { return _streamPaused; }
+
+  // A named stream list. Switching profiles, like calling queryStream() while
+  // a stream runs, doesn't stop the stream: frames still on their way with
+  // the previous list are decoded with it.
+  struct StreamProfile
+  {
+    const char *name;
+    const char *sensors; // zero terminated list of packets
+  };
+  bool setStreamProfile(const StreamProfile &profile); // the profile must outlive the stream
+  const char *streamProfile() const { return _streamProfile; } // name of the streamed profile, NULL if none
   bool refreshData(RoombaInfos *infos);             // Read stream slot
+  bool refreshData(RoombaInfos *infos, SensorMask *changed); // Same, also report the packets that changed
+  bool poll(RoombaInfos *infos);                    // Decode every stream byte received so far, never blocks
+  bool poll(RoombaInfos *infos, SensorMask *changed);
+  const SensorMask &changedSensors() const { return _changedSensors; } // packets changed during the last poll
+  void onFrame(FrameHandler handler) { _frameHandler = handler; }
+  void setOdometry(ArduRoombaOdometry *odometry) { _odometry = odometry; } // updated from frames carrying packets 43 and 44, NULL to detach
+  template <class Signals>
+  void setSignals(Signals *signals) // an ArduRoombaSignals, updated from every frame before the frame handler
+  {
+    _signals = signals;
+    _signalsUpdate = Signals::stage;
+  }
+  void detachSignals() { _signals = NULL; _signalsUpdate = NULL; }
+
+  // Received bytes go through a ring owned by the library, frames are decoded
+  // in place. By default poll() fills it, with setExternalReceive(true) the
+  // sketch does from serialEvent(), a UART RX interrupt or an onReceive() callback.
+  void receive();                 // move every byte the port holds into the ring
+  void receiveByte(byte chunk);   // add one received byte, interrupt safe
+  void setExternalReceive(bool external) { _rxExternal = external; }
+  // Overruns count the bytes the ring dropped in receiveByte(), and once per
+  // receive() call the port overflowing before it: SoftwareSerial::overflow(),
+  // or a full HardwareSerial buffer where the core gives SERIAL_RX_BUFFER_SIZE.
+  // A Stream given by the sketch can't report its own losses.
+  unsigned int rxOverruns() const { return _rxOverruns; }
+
+  // Recording: each frame with a valid checksum is written raw to a Print (a
+  // File, Serial...), after the ms elapsed since the previous one. Nothing is
+  // parsed or formatted. ArduRoombaReplay plays a recording back.
+  void setRecorder(Print *out); // NULL stops the recording
+  unsigned long recordedBytes() const { return _recordedBytes; } // since setRecorder(), to rotate log files
+
+  LinkStats linkStats() const; // counters since the start or the last resetLinkStats()
+  void resetLinkStats();
+
+  // Safety handlers fire from the decoder as soon as a streamed packet changes,
+  // before the rest of the frame is stored
+  void onBump(SensorHandler handler) { _bumpHandler = handler; }               // bump bits of packet 7
+  void onWheelDrop(SensorHandler handler) { _wheelDropHandler = handler; }     // wheel drop bits of packet 7
+  void onCliff(SensorHandler handler) { _cliffHandler = handler; }             // packets 9 - 12
+  void onVirtualWall(SensorHandler handler) { _virtualWallHandler = handler; } // packet 13
+  void onOvercurrent(SensorHandler handler) { _overcurrentHandler = handler; } // packet 14
+
+  // Where the library prints its messages, Serial by default, NULL for nowhere
+  static void setLogOutput(Print *output) { _logOutput = output; }
 
   // Custom commands
-  void roombaSetup(); // Setup the Roomba
+  void roombaSetup(); // Setup the Roomba, blocks until the OI answers or the connection fails
+
+  // Same connection without blocking: beginConnect() once, then serviceConnect()
+  // from loop() until it returns ARDUROOMBA_CONNECT_READY or _FAILED. A running
+  // stream is stopped during the connection and started again once READY.
+  void beginConnect();
+  byte serviceConnect(); // advance the connection, returns its state
+  byte connectState() const { return _connectState; }
+  bool connected() const { return _connectState == ARDUROOMBA_CONNECT_READY; }
   void goForward();   // Move the Roomba forward
   void goBackward();  // Move the Roomba backward
   void turnLeft();    // Turn the Roomba left
   void turnRight();   // Turn the Roomba right
   void halt();        // Stop the Roomba
 
+  // Command transactions, the commands sent in between leave in one write.
+  // Transactions nest, the outermost endCommands() sends the burst.
+  void beginCommands();
+  void endCommands();
+
 private:
-  const byte _zero = 0x00;
+  static Print *_logOutput;
   int _rxPin, _txPin, _brcPin;
-  SoftwareSerial _irobot; // SoftwareSerial instance for communication with the Roomba
+  Stream *_irobot;                    // link to the Roomba
+  HardwareSerial *_hardSerial = NULL; // set when the link is a hardware UART
+#if ARDUROOMBA_SOFTWARESERIAL
+  SoftwareSerial *_softSerial = NULL; // &_softSerialPort when the link is our own SoftwareSerial
+  union {
+    SoftwareSerial _softSerialPort; // only constructed by the SoftwareSerial constructor, no heap
+  };
+#endif
+  long _linkBaud = ARDUROOMBA_DEFAULT_BAUD;
   
-  byte _streamBuffer[100] = {}; 
+  byte _rxBuffer[ARDUROOMBA_RX_BUFFER_SIZE];
+  volatile byte _rxHead = 0; // next byte written by the receive side
+  volatile byte _rxTail = 0; // first byte not consumed yet, the header of the frame being decoded
+  byte _rxScan = 0;          // next byte to decode
+  bool _rxExternal = false;
+  volatile unsigned int _rxOverruns = 0;
+
   int _nbSensorsStream = 0; // number of requested sensors stream
-  int _streamBufferCursor = 0; 
-  char _sensorsStream[60]; // max 52 sensors in OpenInterface spec
+  byte _streamIDs[ARDUROOMBA_STREAM_MAX_FIELDS]; // requested list, kept for the next switch
+  byte _drainIDs[ARDUROOMBA_STREAM_MAX_FIELDS];  // list streamed before the last switch
+  byte _drainCount = 0; // 0 once a frame of the new list arrived
+  byte _drainFrameSize = 0; // content length of its frames
+  bool _streamPaused = false;
+  unsigned long _pausedAt = 0; // millis() of the last pauseStream(), a query waits for the frame on the wire
+  const char *_streamProfile = NULL;
+  byte _streamState = ARDUROOMBA_STREAM_WAIT_HEADER; // decoder state, kept between calls
+  byte _streamRemaining = 0; // content bytes left in the current frame
+  byte _streamChecksum = 0;
+
+  // Where each requested packet lands in a stream frame and in RoombaInfos,
+  // compiled once by queryStream()
+  struct StreamField
+  {
+    byte packetID;
+    byte offset; // offset of the value in the frame content, the ID byte of tagged fields is just before
+    byte format; // wire width and signedness
+    byte dest;   // offset of the destination field in RoombaInfos
+  };
+  StreamField _streamLayout[ARDUROOMBA_STREAM_MAX_FIELDS];
+  byte _streamFieldCount = 0;
+  byte _streamFrameSize = 0; // expected content length of a stream frame
+  bool _streamEncoders = false; // the layout stores both encoder counts
+  bool _frameEncoders = false;  // the last frame was decoded with that layout
+
+  Print *_recorder = NULL;
+  unsigned long _recordAt = 0; // millis() of the last recorded frame
+  unsigned long _recordedBytes = 0;
+
+  LinkStats _linkStats = {};
+  unsigned long _lastFrameAt = 0; // micros() of the last decoded frame, for the gaps
+
+  SensorMask _frameChanges = {};   // packets changed by the last decoded frame
+  SensorMask _changedSensors = {}; // packets changed since the start of the last poll
+  FrameHandler _frameHandler = NULL;
+  ArduRoombaOdometry *_odometry = NULL;
+  void *_signals = NULL;
+  void (*_signalsUpdate)(void *signals, const RoombaInfos &infos) = NULL;
+  SensorHandler _bumpHandler = NULL;
+  SensorHandler _wheelDropHandler = NULL;
+  SensorHandler _cliffHandler = NULL;
+  SensorHandler _virtualWallHandler = NULL;
+  SensorHandler _overcurrentHandler = NULL;
+
+  byte _queryState = ARDUROOMBA_QUERY_IDLE;
+  byte _queryIDs[ARDUROOMBA_QUERY_MAX_PACKETS];
+  byte _queryCount = 0;
+  byte _queryLength = 0; // data bytes of the reply
+  bool _queryResume = false; // the stream was paused for the query
+  unsigned long _queryAt = 0;
+  unsigned int _queryWait = 0;
+
+  byte _connectState = ARDUROOMBA_CONNECT_IDLE;
+  byte _connectStep = 0;       // BRC pulses or mode queries done
+  bool _connectQuery = false;  // a mode query waits for its reply
+  bool _connectResume = false; // a stream ran before beginConnect(), restarted once READY
+  unsigned long _connectAt = 0; // time the current state was entered
+  unsigned int _connectWait = 0; // ms to stay in the current state
+
+  struct DriveCommand
+  {
+    byte opcode; // 137, 145 or 146, 0 when unknown
+    int first, second;
+  };
+  DriveCommand _driveSetpoint = {};
+  DriveCommand _driveSent = {}; // last drive command on the wire
+  bool _drivePending = false;
+  unsigned int _driveInterval = ARDUROOMBA_DRIVE_INTERVAL;
+  unsigned long _driveSentAt = 0;
+
+  // Shadow of the outputs last written, see forgetOutputs()
+  byte _ledState[3];           // leds() bytes
+  byte _schedulingLedState[2]; // schedulingLeds() bytes
+  byte _digitState[4];         // digitLedsRaw() bytes
+  byte _outputsKnown = 0;      // ARDUROOMBA_OUTPUT_* bits of the valid shadows
+#if ARDUROOMBA_SONG_CACHE
+  byte _songState[5][1 + 2 * 16]; // length and notes of each slot, as sent
+#endif
+  byte _songsLoaded = 0;       // bit per song slot with a known content
+
+  byte _txBuffer[ARDUROOMBA_TX_BUFFER_SIZE];
+  byte _txLength = 0; // bytes queued in _txBuffer
+  byte _txDepth = 0;  // open transactions
 
+  void _openLink(long baud); // (re)open the local port when we own it
+  void _send(const byte *command, byte len); // write a whole command, or queue it inside a transaction
+  void _sendOpcode(byte opcode) { _send(&opcode, 1); }
+  void _flushCommands(); // write the queued commands
+  void _sendDrive(byte opcode, int first, int second); // every drive command goes through here
+  bool _sendOutput(byte output, byte *shadow, const byte *command, byte len); // send unless the shadow holds the same bytes
+  void _sendMode(byte opcode); // mode commands, the OI resets its outputs
+  bool _verifyLink(); // ask for the OI mode and check the reply
+  bool _switchLink(char baudCode, long rate); // send the baud command, reopen the port and check the link
+  void _queryMode(); // ask for the mode packet, the reply is read by the caller
+  void _restartStream(); // send the current list again
+  void _connectNext(byte state, unsigned int wait);
   int _sensorsListLength(char sensorlist[]); // determines the size of the table
-  bool _readStream(); // read stream data and fill _streamBuffer and return checksum result
-  bool _parseStreamBuffer(byte *packets, int len, RoombaInfos *infos); // parse _streamBuffer and return checksum result
-  byte _parseOneByteStreamBuffer(byte *packets, int &start);
-  int _parseTwoByteStreamBuffer(byte *packets, int &start);
-  void _parseAndFillOneByteStreamBuffer(byte *packets, int &start, bool *bytes);
+  static bool _streamFieldFormat(byte packetID, byte *format, byte *dest); // false for unknown packets
+  bool _compileStreamPacket(byte packetID, StreamField *layout, int &fields, int &size); // append the fields of one requested packet
+  int _rxAvailable(); // received bytes not consumed yet
+  int _rxRead();      // consume one byte outside of the stream decoder, -1 if none
+  void _rxSkip(byte count); // consume bytes read in place
+  void _rxClear();
+  bool _readStream(RoombaInfos *infos); // decode all received bytes, return true if a frame was parsed
+  bool _parseStreamBuffer(byte start, int len, RoombaInfos *infos); // decode a frame in the ring with _streamLayout
+  bool _parseFrame(byte start, int len, RoombaInfos *infos); // current layout, then the previous list
+  bool _parseStreamList(const byte *packetIDs, byte count, byte start, int len, RoombaInfos *infos);
+  byte _storePacket(byte packetID, byte at, RoombaInfos *infos); // returns the data bytes of the packet
+  void _storeField(byte packetID, byte format, byte dest, byte at, RoombaInfos *infos); // store a value of the ring, at is unmasked
+  void _handleFrame(RoombaInfos *infos); // run once per decoded frame
+  void _checkModeChange(); // after a frame or a query reply
+  void _recordFrame(); // write the frame between _rxTail and _rxScan to _recorder
+  unsigned int _replyTimeout(int bytes) const; // ms to receive bytes at the link rate
+  void _sendQuery();
+  void _storeQueryReply(RoombaInfos *infos);
+  void _dispatchSafety(byte packetID, byte previous, byte current);
 };
 
 #endif
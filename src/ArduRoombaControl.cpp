@@ -0,0 +1,84 @@
+#include "ArduRoombaControl.h"
+
+#define ARDUROOMBA_CONTROL_MAX_INTEGRAL 200000L // mm/s * ms, bounds the windup
+
+void ArduRoombaVelocityControl::_reset()
+{
+  _right.integral = _left.integral = 0;
+  _active = true;
+}
+
+void ArduRoombaVelocityControl::setSpeeds(int rightSpeed, int leftSpeed)
+{
+  if (!_active || _holdHeading) {
+    _reset();
+  }
+  _holdHeading = false;
+  _right.target = rightSpeed;
+  _left.target = leftSpeed;
+}
+
+void ArduRoombaVelocityControl::holdHeading(int speed, uint16_t heading)
+{
+  if (!_active || !_holdHeading) {
+    _reset();
+  }
+  _holdHeading = true;
+  _speed = speed;
+  _heading = heading;
+}
+
+void ArduRoombaVelocityControl::stop()
+{
+  _active = false;
+  _right.pwm = _left.pwm = 0;
+  _roomba.drivePWM(0, 0);
+}
+
+void ArduRoombaVelocityControl::_step(Wheel &wheel, int counts, unsigned long elapsed)
+{
+  // counts to mm in 1/256 mm, then mm/s
+  long distance = ((long)counts * ARDUROOMBA_ODOMETRY_DISTANCE_PER_COUNT) >> 8;
+  wheel.measured = (distance * 1000 / (long)elapsed) >> 8;
+
+  int error = wheel.target - wheel.measured;
+  long output = ((long)wheel.target * _feedforward + (long)error * _kp) >> 8;
+  long integral = wheel.integral + (long)error * (long)elapsed;
+  integral = constrain(integral, -ARDUROOMBA_CONTROL_MAX_INTEGRAL, ARDUROOMBA_CONTROL_MAX_INTEGRAL);
+  long total = output + ((integral / 1000) * _ki >> 8);
+  if (total > ARDUROOMBA_CONTROL_MAX_PWM || total < -ARDUROOMBA_CONTROL_MAX_PWM) {
+    total = constrain(total, -ARDUROOMBA_CONTROL_MAX_PWM, ARDUROOMBA_CONTROL_MAX_PWM);
+    if ((error > 0) != (total > 0)) {
+      wheel.integral = integral; // only integrate back out of the saturation
+    }
+  } else {
+    wheel.integral = integral;
+  }
+  wheel.pwm = total;
+}
+
+bool ArduRoombaVelocityControl::update()
+{
+  unsigned long elapsed = _odometry.deltaTime();
+  if (!_active || elapsed == 0 || elapsed > ARDUROOMBA_CONTROL_MAX_ELAPSED) {
+    return false; // nothing new, or counts from before a pause
+  }
+  if (_holdHeading) {
+    // heading error as a signed binary angle, positive when the robot has to turn left
+    int16_t error = (int16_t)(_heading - _odometry.heading());
+    long correction = ((long)error * _kh) >> 8;
+    correction = constrain(correction, -ARDUROOMBA_CONTROL_MAX_CORRECTION, ARDUROOMBA_CONTROL_MAX_CORRECTION);
+    _right.target = _speed + correction;
+    _left.target = _speed - correction;
+  }
+  _step(_right, _odometry.deltaRightCounts(), elapsed);
+  _step(_left, _odometry.deltaLeftCounts(), elapsed);
+
+  unsigned long now = millis();
+  if (now - _sentAt < ARDUROOMBA_CONTROL_MIN_GAP) {
+    return false; // frames decoded in a burst, keep the OI command rate
+  }
+  _sentAt = now;
+  _roomba.drivePWM(_right.pwm, _left.pwm);
+  return true;
+}
@@ -0,0 +1,77 @@
+#ifndef ArduRoombaControl_h
+#define ArduRoombaControl_h
+
+#include "ArduRoomba.h"
+#include "ArduRoombaOdometry.h"
+
+// Gains, 8 fractional bits
+#define ARDUROOMBA_CONTROL_KP 96        // PWM per mm/s of speed error
+#define ARDUROOMBA_CONTROL_KI 256       // PWM per mm of accumulated error
+#define ARDUROOMBA_CONTROL_FEEDFORWARD 130 // PWM per mm/s of target, about 255 at 500 mm/s
+#define ARDUROOMBA_CONTROL_KH 14        // mm/s of wheel difference per binary angle unit of heading error
+#define ARDUROOMBA_CONTROL_MAX_PWM 255
+#define ARDUROOMBA_CONTROL_MAX_CORRECTION 100 // mm/s the heading loop may add to a wheel
+#define ARDUROOMBA_CONTROL_MIN_GAP (ARDUROOMBA_STREAM_SLOT - 2) // ms between two commands, frames detected 14 ms apart still count
+#define ARDUROOMBA_CONTROL_MAX_ELAPSED (3 * ARDUROOMBA_STREAM_SLOT) // ms, a longer frame gap spans a pause and isn't integrated
+
+// PI wheel speed control on the measured encoder speeds, with drivePWM().
+// The speeds come from an ArduRoombaOdometry attached to the robot, so the
+// stream has to carry packets 43 and 44. update() runs from the frame
+// handler, right after the odometry, and sends one command per frame, none
+// for frames decoded back to back. The first update after a stream pause, a
+// query or a new odometry covers too long a time to be a speed sample, it is
+// skipped and the next frame starts from there.
+//
+//   ArduRoombaOdometry odometry;
+//   ArduRoombaVelocityControl control(roomba, odometry);
+//   void onFrame(const ArduRoomba::RoombaInfos &, const ArduRoomba::SensorMask &) { control.update(); }
+//   ...
+//   control.holdHeading(200, odometry.heading()); // straight line at 200 mm/s
+class ArduRoombaVelocityControl
+{
+public:
+  ArduRoombaVelocityControl(ArduRoomba &roomba, const ArduRoombaOdometry &odometry)
+      : _roomba(roomba), _odometry(odometry) {}
+
+  void setSpeeds(int rightSpeed, int leftSpeed); // mm/s per wheel
+  void holdHeading(int speed, uint16_t heading); // both wheels at speed, steered to keep the odometry heading
+  void stop();                                   // zero PWM, the controller is released
+  bool active() const { return _active; }
+
+  void setGains(int kp, int ki, int feedforward) { _kp = kp; _ki = ki; _feedforward = feedforward; }
+  void setHeadingGain(int kh) { _kh = kh; }
+
+  bool update(); // once per frame, true if a PWM command was sent
+
+  int rightPWM() const { return _right.pwm; }
+  int leftPWM() const { return _left.pwm; }
+  int rightSpeed() const { return _right.measured; } // mm/s over the last frame, in steps of about 30 mm/s at 15 ms
+  int leftSpeed() const { return _left.measured; }
+
+private:
+  struct Wheel
+  {
+    int target;    // mm/s
+    int measured;  // mm/s
+    long integral; // mm/s * ms of error
+    int pwm;
+  };
+
+  ArduRoomba &_roomba;
+  const ArduRoombaOdometry &_odometry;
+  bool _active = false;
+  bool _holdHeading = false;
+  int _speed = 0;
+  uint16_t _heading = 0;
+  Wheel _right = {}, _left = {};
+  int _kp = ARDUROOMBA_CONTROL_KP;
+  int _ki = ARDUROOMBA_CONTROL_KI;
+  int _feedforward = ARDUROOMBA_CONTROL_FEEDFORWARD;
+  int _kh = ARDUROOMBA_CONTROL_KH;
+  unsigned long _sentAt = 0;
+
+  void _reset();
+  void _step(Wheel &wheel, int counts, unsigned long elapsed);
+};
+
+#endif
@@ -0,0 +1,118 @@
+#ifndef ArduRoombaFleet_h
+#define ArduRoombaFleet_h
+
+#include "ArduRoomba.h"
+
+// Several robots on one MCU, each on its own hardware UART (Mega, ESP32...).
+// poll() runs the decoder of every robot in turn and keeps a snapshot and
+// the frame timing of each one. Memory is set by Robots: a snapshot, a
+// change mask and a few counters per robot, about 120 bytes each.
+//
+//   ArduRoomba left(Serial1, 4), right(Serial2, 5);
+//   ArduRoombaFleet<2> fleet;
+//   fleet.add(left);
+//   fleet.add(right);
+//   ...
+//   fleet.poll();
+//   if (fleet.infos(1).bumpLeft()) fleet.robot(1).halt();
+//
+// SoftwareSerial only listens on one port at a time, so at most one robot
+// of the fleet may use it: add() refuses a second one.
+template <byte Robots>
+class ArduRoombaFleet
+{
+public:
+  // Called after a robot decoded a frame, with the packets changed since its previous poll
+  typedef void (*RobotHandler)(byte robot, const ArduRoomba::RoombaInfos &infos, const ArduRoomba::SensorMask &changed);
+
+  int add(ArduRoomba &roomba) // index of the robot, -1 if the fleet is full or a second SoftwareSerial link is added
+  {
+    if (_count == Robots || (roomba.softwareSerialLink() && _softwareSerial())) {
+      return -1;
+    }
+    Robot &robot = _robots[_count];
+    robot.roomba = &roomba;
+    memset(&robot.infos, 0, sizeof(robot.infos));
+    robot.changed.clear();
+    robot.frames = 0;
+    robot.lastFrameAt = 0;
+    return _count++;
+  }
+
+  // Poll each robot once, starting after the last one served. With a budget,
+  // in microseconds, the round stops once it's spent and the next call goes on
+  // from the next robot. Returns the number of robots that decoded a frame.
+  byte poll(unsigned long budget = 0)
+  {
+    byte decoded = 0;
+    unsigned long start = micros();
+    for (byte served = 0; served < _count; served++) {
+      byte index = _next;
+      _next = (_next + 1) % _count;
+      Robot &robot = _robots[index];
+      if (robot.roomba->poll(&robot.infos, &robot.changed)) {
+        robot.frames++;
+        robot.lastFrameAt = millis();
+        decoded++;
+        if (_handler) {
+          _handler(index, robot.infos, robot.changed);
+        }
+      }
+      if (budget && micros() - start >= budget) {
+        break;
+      }
+    }
+    return decoded;
+  }
+
+  void onFrame(RobotHandler handler) { _handler = handler; }
+
+  byte size() const { return _count; }
+  ArduRoomba &robot(byte index) { return *_robots[index].roomba; }
+  const ArduRoomba::RoombaInfos &infos(byte index) const { return _robots[index].infos; }
+  const ArduRoomba::SensorMask &changedSensors(byte index) const { return _robots[index].changed; } // during its last poll
+
+  // Health of each link
+  ArduRoomba::LinkStats linkStats(byte index) const { return _robots[index].roomba->linkStats(); }
+  unsigned long frames(byte index) const { return _robots[index].frames; } // frames decoded since add()
+  unsigned long frameAge(byte index) const { return millis() - _robots[index].lastFrameAt; } // ms since its last frame
+  bool stale(byte index, unsigned long timeout) const { return !_robots[index].frames || frameAge(index) > timeout; }
+  int staleRobot(unsigned long timeout) const // first robot without a frame for timeout ms, -1 if none
+  {
+    for (byte i = 0; i < _count; i++) {
+      if (stale(i, timeout)) {
+        return i;
+      }
+    }
+    return -1;
+  }
+
+private:
+  struct Robot
+  {
+    ArduRoomba *roomba;
+    ArduRoomba::RoombaInfos infos;
+    ArduRoomba::SensorMask changed;
+    unsigned long frames;
+    unsigned long lastFrameAt; // millis()
+  };
+
+  Robot _robots[Robots];
+  byte _count = 0;
+  byte _next = 0; // robot polled first by the next round
+  RobotHandler _handler = NULL;
+
+  bool _softwareSerial() const
+  {
+    for (byte i = 0; i < _count; i++) {
+      if (_robots[i].roomba->softwareSerialLink()) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  static_assert(Robots > 0, "empty fleet");
+};
+
+#endif
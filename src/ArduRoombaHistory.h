@@ -0,0 +1,155 @@
+#ifndef ArduRoombaHistory_h
+#define ArduRoombaHistory_h
+
+#include "ArduRoomba.h"
+
+// Last Capacity snapshots of up to Fields packets, each with the micros() of
+// the frame. Only the selected packets are kept, two bytes each, so a
+// history of 32 frames of 4 packets takes about 400 bytes.
+//
+//   ArduRoombaHistory<32> history;
+//   history.track(ARDUROOMBA_SENSOR_VOLTAGE);
+//   void onFrame(const ArduRoomba::RoombaInfos &infos, const ArduRoomba::SensorMask &) { history.record(infos); }
+//   ...
+//   long average = history.mean(ARDUROOMBA_SENSOR_VOLTAGE, 16);
+//
+// Ages count frames back from the newest one, age 0. Windowed queries look at
+// the last frames recorded, fewer if the history isn't full yet.
+template <byte Capacity, byte Fields = 4>
+class ArduRoombaHistory
+{
+public:
+  bool track(byte packetID) // false for groups, unknown packets or when Fields are tracked already
+  {
+    bool wide, isSigned;
+    if (_fieldCount == Fields || _field(packetID) >= 0 ||
+        !ArduRoomba::sensorLocation(packetID, &_offsets[_fieldCount], &wide, &isSigned)) {
+      return false;
+    }
+    _ids[_fieldCount] = packetID;
+    _formats[_fieldCount] = (wide ? FORMAT_WIDE : 0) | (isSigned ? FORMAT_SIGNED : 0);
+    _fieldCount++;
+    clear(); // older frames don't have the new field
+    return true;
+  }
+
+  void record(const ArduRoomba::RoombaInfos &infos) // once per frame, from onFrame()
+  {
+    _head = (_head + 1) % Capacity;
+    if (_count < Capacity) {
+      _count++;
+    }
+    _times[_head] = micros();
+    const byte *snapshot = (const byte *)&infos;
+    for (byte i = 0; i < _fieldCount; i++) {
+      const byte *src = snapshot + _offsets[i];
+      _values[_head][i] = (_formats[i] & FORMAT_WIDE) ? *(const uint16_t *)src : *src;
+    }
+  }
+
+  void clear() { _count = 0; }
+  byte size() const { return _count; } // frames recorded, up to Capacity
+
+  unsigned long timestamp(byte age = 0) const { return age < _count ? _times[_slot(age)] : 0; } // micros() of the frame
+  unsigned long span(byte frames) const // micros() between the oldest and the newest of the last frames
+  {
+    frames = _window(frames);
+    return frames ? _times[_head] - _times[_slot(frames - 1)] : 0;
+  }
+
+  long value(byte packetID, byte age = 0) const // 0 for untracked packets and frames not recorded
+  {
+    int field = _field(packetID);
+    return field >= 0 && age < _count ? _decode(field, _slot(age)) : 0;
+  }
+
+  long minimum(byte packetID, byte frames) const
+  {
+    long result = 0;
+    _scan(packetID, frames, &result, NULL, NULL);
+    return result;
+  }
+
+  long maximum(byte packetID, byte frames) const
+  {
+    long result = 0;
+    _scan(packetID, frames, NULL, &result, NULL);
+    return result;
+  }
+
+  long mean(byte packetID, byte frames) const // rounded toward zero
+  {
+    long sum = 0;
+    frames = _window(frames);
+    return _scan(packetID, frames, NULL, NULL, &sum) ? sum / frames : 0;
+  }
+
+private:
+  enum
+  {
+    FORMAT_WIDE = 0x01,
+    FORMAT_SIGNED = 0x02
+  };
+
+  uint16_t _values[Capacity][Fields];
+  unsigned long _times[Capacity];
+  byte _ids[Fields];
+  byte _offsets[Fields];
+  byte _formats[Fields];
+  byte _fieldCount = 0;
+  byte _head = Capacity - 1; // slot of the newest frame
+  byte _count = 0;
+
+  int _field(byte packetID) const
+  {
+    for (byte i = 0; i < _fieldCount; i++) {
+      if (_ids[i] == packetID) {
+        return i;
+      }
+    }
+    return -1;
+  }
+
+  byte _window(byte frames) const { return frames < _count ? frames : _count; }
+  byte _slot(byte age) const { return (_head + Capacity - age) % Capacity; }
+
+  long _decode(byte field, byte slot) const
+  {
+    uint16_t raw = _values[slot][field];
+    if (!(_formats[field] & FORMAT_SIGNED)) {
+      return raw;
+    }
+    return (_formats[field] & FORMAT_WIDE) ? (long)(int16_t)raw : (long)(int8_t)raw;
+  }
+
+  bool _scan(byte packetID, byte frames, long *low, long *high, long *sum) const
+  {
+    int field = _field(packetID);
+    frames = _window(frames);
+    if (field < 0 || frames == 0) {
+      return false;
+    }
+    long first = _decode(field, _head);
+    long lowest = first, highest = first, total = 0;
+    for (byte age = 0; age < frames; age++) {
+      long v = _decode(field, _slot(age));
+      lowest = v < lowest ? v : lowest;
+      highest = v > highest ? v : highest;
+      total += v;
+    }
+    if (low) {
+      *low = lowest;
+    }
+    if (high) {
+      *high = highest;
+    }
+    if (sum) {
+      *sum = total;
+    }
+    return true;
+  }
+
+  static_assert(Capacity > 0, "empty history");
+};
+
+#endif
@@ -0,0 +1,125 @@
+#ifndef ArduRoombaMock_h
+#define ArduRoombaMock_h
+
+#include "ArduRoomba.h"
+
+// A Stream standing in for the OI link, to run the decoder without a robot:
+// it replays captured bytes in chunks of irregular size (frames split
+// between polls, bursts of arrivals), optionally with corrupted bytes.
+// Bytes only arrive when deliver() is called. Commands written to it are
+// only counted.
+//
+//   ArduRoombaMockStream mock;
+//   ArduRoomba roomba(mock, -1);
+//   mock.load(capture, sizeof(capture));
+//   mock.setChunk(1, 8);           // 1 - 8 bytes per delivery
+//   mock.setCorruption(500);       // one bad byte every 500
+//   mock.deliver();
+//   roomba.poll(&infos);
+class ArduRoombaMockStream : public Stream
+{
+public:
+  void load(const byte *data, unsigned int length, bool repeat = true) // the bytes must outlive the replay
+  {
+    _data = data;
+    _length = length;
+    _repeat = repeat;
+    rewind();
+  }
+  void rewind()
+  {
+    _position = 0;
+    _released = 0;
+    _sinceCorrupt = 0;
+  }
+
+  // Bytes made available by deliver(), drawn between minimum and maximum
+  void setChunk(byte minimum, byte maximum)
+  {
+    _chunkMin = minimum;
+    _chunkMax = maximum < minimum ? minimum : maximum;
+  }
+  void deliver(unsigned int count = 0) // the next chunk arrives, count bytes instead if given
+  {
+    unsigned long total = (unsigned long)_released + (count ? count : _chunkMin + _next() % (_chunkMax - _chunkMin + 1));
+    _released = total < 0x7FFF ? total : 0x7FFF; // available() is an int
+  }
+  void setCorruption(unsigned int every) { _corruptEvery = every; } // flip a bit every that many bytes read, 0 never
+  void seed(uint16_t value) { _random = value ? value : 1; }
+
+  unsigned long bytesRead() const { return _bytesRead; }
+  unsigned long bytesWritten() const { return _bytesWritten; }
+  unsigned long corrupted() const { return _corrupted; }
+  bool finished() const { return !_repeat && _position >= _length; }
+
+  // Stream, only the delivered bytes are available
+  int available()
+  {
+    if (!_length) {
+      return 0;
+    }
+    unsigned int left = _repeat ? 0x7FFF : _length - _position;
+    return _released < left ? _released : left;
+  }
+  int peek() { return available() ? _byteAt() : -1; }
+  int read()
+  {
+    if (!available()) {
+      return -1;
+    }
+    byte value = _byteAt();
+    _released--;
+    _bytesRead++;
+    if (++_position == _length && _repeat) {
+      _position = 0;
+    }
+    if (_corruptEvery && ++_sinceCorrupt >= _corruptEvery) {
+      _sinceCorrupt = 0;
+      _corrupted++;
+      value ^= 1 << (_next() & 7);
+    }
+    return value;
+  }
+  size_t write(uint8_t) { _bytesWritten++; return 1; }
+  size_t write(const uint8_t *, size_t size) { _bytesWritten += size; return size; }
+  void flush() {}
+  using Print::write;
+
+  // Wrap content into a stream frame: header, size, content and checksum.
+  // out needs length + 3 bytes, returns the frame length.
+  static byte frame(const byte *content, byte length, byte *out)
+  {
+    byte sum = ARDUROOMBA_STREAM_HEADER + length;
+    out[0] = ARDUROOMBA_STREAM_HEADER;
+    out[1] = length;
+    for (byte i = 0; i < length; i++) {
+      out[2 + i] = content[i];
+      sum += content[i];
+    }
+    out[2 + length] = -sum;
+    return length + 3;
+  }
+
+private:
+  const byte *_data = NULL;
+  unsigned int _length = 0;
+  unsigned int _position = 0;
+  bool _repeat = true;
+  uint16_t _released = 0; // delivered bytes not read yet
+  byte _chunkMin = 32, _chunkMax = 32;
+  unsigned int _corruptEvery = 0;
+  unsigned int _sinceCorrupt = 0;
+  uint16_t _random = 0xACE1;
+  unsigned long _bytesRead = 0, _bytesWritten = 0, _corrupted = 0;
+
+  byte _byteAt() const { return _data[_position]; }
+  uint16_t _next() // 16 bit xorshift, same sequence on every board
+  {
+    _random ^= _random << 7;
+    _random ^= _random >> 9;
+    _random ^= _random << 8;
+    return _random;
+  }
+};
+
+#endif
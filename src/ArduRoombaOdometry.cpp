@@ -0,0 +1,71 @@
+#include "ArduRoombaOdometry.h"
+
+// sin() of 0 - 90 degrees in 64 steps, 14 fractional bits
+static const int16_t _sineTable[65] PROGMEM = {
+    0, 402, 804, 1205, 1606, 2006, 2404, 2801, 3196, 3590, 3981, 4370, 4756,
+    5139, 5520, 5897, 6270, 6639, 7005, 7366, 7723, 8076, 8423, 8765, 9102,
+    9434, 9760, 10080, 10394, 10702, 11003, 11297, 11585, 11866, 12140, 12406,
+    12665, 12916, 13160, 13395, 13623, 13842, 14053, 14256, 14449, 14635, 14811,
+    14978, 15137, 15286, 15426, 15557, 15679, 15791, 15893, 15986, 16069, 16143,
+    16207, 16261, 16305, 16340, 16364, 16379, 16384};
+
+int16_t ArduRoombaOdometry::sine(uint16_t angle)
+{
+  // quadrant, step in the quadrant, then a linear interpolation on the low byte
+  byte quadrant = angle >> 14;
+  byte step = (angle >> 8) & 0x3F;
+  byte fraction = angle & 0xFF;
+  if (quadrant & 1) {
+    step = 63 - step;
+    fraction = 255 - fraction;
+  }
+  int16_t from = pgm_read_word(&_sineTable[step]);
+  int16_t to = pgm_read_word(&_sineTable[step + 1]);
+  int16_t value = from + (int16_t)(((int32_t)(to - from) * fraction + 128) >> 8);
+  return quadrant & 2 ? -value : value;
+}
+
+void ArduRoombaOdometry::reset(long x, long y, uint16_t heading)
+{
+  _x = x;
+  _y = y;
+  _heading = (uint32_t)heading << 16;
+  _synced = false;
+  _deltaLeft = _deltaRight = 0;
+  _deltaDistance = 0;
+  _deltaHeading = 0;
+  _deltaTime = 0;
+}
+
+void ArduRoombaOdometry::update(const ArduRoomba::RoombaInfos &infos)
+{
+  unsigned long now = millis();
+  // the counts wrap at 16 bits, the difference as int16_t stays right across the wrap
+  int16_t left = (int16_t)(infos.leftEncoderCounts - _lastLeft);
+  int16_t right = (int16_t)(infos.rightEncoderCounts - _lastRight);
+  _lastLeft = infos.leftEncoderCounts;
+  _lastRight = infos.rightEncoderCounts;
+  _deltaTime = now - _lastAt;
+  _lastAt = now;
+
+  if (!_synced || abs(left) > ARDUROOMBA_ODOMETRY_MAX_STEP || abs(right) > ARDUROOMBA_ODOMETRY_MAX_STEP) {
+    // first counts, or the encoders were reset: nothing to integrate
+    _synced = true;
+    _deltaLeft = _deltaRight = 0;
+    _deltaDistance = 0;
+    _deltaHeading = 0;
+    return;
+  }
+
+  _deltaLeft = left;
+  _deltaRight = right;
+  // (left + right) / 2 * mm per count, in 1/256 mm
+  _deltaDistance = ((int32_t)(left + right) * ARDUROOMBA_ODOMETRY_DISTANCE_PER_COUNT + 256) >> 9;
+  _deltaHeading = (int32_t)(right - left) * ARDUROOMBA_ODOMETRY_TURN_PER_COUNT;
+
+  // move along the mean heading of the step
+  uint16_t middle = (_heading + (_deltaHeading >> 1)) >> 16;
+  _x += ((int32_t)_deltaDistance * cosine(middle) + 8192) >> 14;
+  _y += ((int32_t)_deltaDistance * sine(middle) + 8192) >> 14;
+  _heading += _deltaHeading;
+}
@@ -0,0 +1,53 @@
+#ifndef ArduRoombaOdometry_h
+#define ArduRoombaOdometry_h
+
+#include "ArduRoomba.h"
+
+// Create 2 geometry, 508.8 encoder counts per turn of a 72 mm wheel, 235 mm wheelbase
+#define ARDUROOMBA_ODOMETRY_DISTANCE_PER_COUNT 29135L  // mm per count, 16 fractional bits
+#define ARDUROOMBA_ODOMETRY_TURN_PER_COUNT 1293146L    // heading per count of wheel difference, 2^32 per turn
+#define ARDUROOMBA_ODOMETRY_MAX_STEP 800 // counts between two updates, a larger jump resynchronizes instead of moving
+
+// Dead reckoning from the encoder counts (packets 43 and 44), in integer
+// math only. Attached with ArduRoomba::setOdometry(), it is updated once per
+// decoded frame when the stream carries both encoders.
+//
+// Positions are in 1/256 mm, headings are binary angles: 65536 is a full
+// turn, 0 is the x axis, counterclockwise is positive.
+class ArduRoombaOdometry
+{
+public:
+  void reset(long x = 0, long y = 0, uint16_t heading = 0); // set the pose, in 1/256 mm
+  void update(const ArduRoomba::RoombaInfos &infos);       // integrate the counts of a new snapshot
+
+  long x() const { return _x >> 8; } // mm
+  long y() const { return _y >> 8; } // mm
+  long rawX() const { return _x; }   // 1/256 mm
+  long rawY() const { return _y; }   // 1/256 mm
+  uint16_t heading() const { return _heading >> 16; }
+  int headingDegrees() const { return (((unsigned long)heading() * 360 + 32768) >> 16) % 360; } // 0 - 359
+
+  // Deltas of the last update
+  int deltaLeftCounts() const { return _deltaLeft; }
+  int deltaRightCounts() const { return _deltaRight; }
+  long deltaDistance() const { return _deltaDistance; } // 1/256 mm traveled by the center
+  int16_t deltaHeading() const { return _deltaHeading >> 16; }
+  unsigned long deltaTime() const { return _deltaTime; } // ms since the previous update
+
+  static int16_t sine(uint16_t angle);   // 14 fractional bits
+  static int16_t cosine(uint16_t angle) { return sine(angle + 16384); }
+
+private:
+  long _x = 0, _y = 0;
+  uint32_t _heading = 0; // 2^32 per turn, the low bits keep the sub-step rotation
+  uint16_t _lastLeft = 0, _lastRight = 0;
+  unsigned long _lastAt = 0;
+  bool _synced = false; // _last* hold counts of a previous update
+
+  int _deltaLeft = 0, _deltaRight = 0;
+  long _deltaDistance = 0;
+  int32_t _deltaHeading = 0;
+  unsigned long _deltaTime = 0;
+};
+
+#endif
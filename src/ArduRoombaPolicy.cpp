@@ -0,0 +1,95 @@
+#include "ArduRoombaPolicy.h"
+
+bool ArduRoombaStreamPolicy::looksDocked(const ArduRoomba::RoombaInfos &infos)
+{
+  // charging states 1 - 4 are reconditioning, full, trickle and waiting
+  bool charger = infos.homeBaseChargerAvailable() || (infos.chargingState >= 1 && infos.chargingState <= 4);
+  bool moving = infos.velocity || infos.rightVelocity || infos.leftVelocity;
+  return charger && infos.mode <= 1 && !moving;
+}
+
+bool ArduRoombaStreamPolicy::begin()
+{
+  _state = ARDUROOMBA_POLICY_ACTIVE;
+  _dockedSince = 0;
+  return _roomba.setStreamProfile(_active);
+}
+
+void ArduRoombaStreamPolicy::update(const ArduRoomba::RoombaInfos &infos)
+{
+  unsigned long now = millis();
+  bool dockedNow = looksDocked(infos);
+  // the same snapshot comes back on every loop between two queries, only
+  // new frames or replies are samples
+  bool fresh = infos.lastSuccedRefresh != _sampleAt;
+  _sampleAt = infos.lastSuccedRefresh;
+
+  if (_state == ARDUROOMBA_POLICY_ACTIVE) {
+    if (!dockedNow) {
+      _dockedSince = 0;
+    } else if (!_dockedSince) {
+      _dockedSince = now ? now : 1;
+    } else if (now - _dockedSince >= _dockDelay) {
+      _enterDocked();
+    }
+    return;
+  }
+
+  // Safe or Full mode, or motion, is acted on at once. A charger that goes
+  // away has to stay away for a few samples, its bits flicker on contact.
+  bool moving = infos.velocity || infos.rightVelocity || infos.leftVelocity;
+  if (infos.mode >= 2 || moving) {
+    _enterActive();
+    return;
+  }
+  if (fresh) {
+    _undockSamples = dockedNow ? 0 : _undockSamples + 1;
+  }
+  if (_undockSamples >= ARDUROOMBA_POLICY_UNDOCK_SAMPLES) {
+    _enterActive();
+    return;
+  }
+  if (_pollInterval && now - _polledAt >= _pollInterval) {
+    _query();
+  }
+}
+
+void ArduRoombaStreamPolicy::wake()
+{
+  if (_state == ARDUROOMBA_POLICY_DOCKED) {
+    _enterActive();
+  }
+  _dockedSince = 0;
+}
+
+void ArduRoombaStreamPolicy::_enterDocked()
+{
+  _state = ARDUROOMBA_POLICY_DOCKED;
+  _undockSamples = 0;
+  _switches++;
+  if (_pollInterval) {
+    _roomba.pauseStream(); // stays paused, the query waits for the frame on the wire
+    _query();
+  } else {
+    _roomba.setStreamProfile(_docked);
+  }
+}
+
+void ArduRoombaStreamPolicy::_enterActive()
+{
+  _state = ARDUROOMBA_POLICY_ACTIVE;
+  _dockedSince = 0;
+  _switches++;
+  _roomba.setStreamProfile(_active); // also restarts a paused stream
+}
+
+void ArduRoombaStreamPolicy::_query()
+{
+  _polledAt = millis();
+  byte state = _roomba.queryState();
+  if (state == ARDUROOMBA_QUERY_QUIET || state == ARDUROOMBA_QUERY_WAIT) {
+    return; // the previous reply is still on its way
+  }
+  size_t count = strlen(_docked.sensors);
+  _roomba.requestSensors((const byte *)_docked.sensors, count < ARDUROOMBA_QUERY_MAX_PACKETS ? count : ARDUROOMBA_QUERY_MAX_PACKETS);
+}
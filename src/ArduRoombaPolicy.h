@@ -0,0 +1,65 @@
+#ifndef ArduRoombaPolicy_h
+#define ArduRoombaPolicy_h
+
+#include "ArduRoomba.h"
+
+#define ARDUROOMBA_POLICY_DOCK_DELAY 5000  // ms the robot has to look docked before the switch
+#define ARDUROOMBA_POLICY_POLL_INTERVAL 1000 // ms between two queries while docked
+#define ARDUROOMBA_POLICY_UNDOCK_SAMPLES 2 // frames or query replies without a charger before leaving the docked state
+
+#define ARDUROOMBA_POLICY_ACTIVE 0
+#define ARDUROOMBA_POLICY_DOCKED 1
+
+// Picks the stream from the robot state. While the robot sits on a charger
+// and doesn't move, the active profile is replaced by the docked one, or by a
+// query of its packets every few seconds with the stream off. Safe or Full
+// mode, motion or the loss of the charger bring the active profile back.
+//
+//   ArduRoomba::StreamProfile active = {"active", activeList};
+//   ArduRoomba::StreamProfile docked = {"docked", dockedList}; // 21, 34, 35, 25...
+//   ArduRoombaStreamPolicy policy(roomba, active, docked);
+//   void setup() { ...; policy.begin(); }
+//   void loop() { roomba.poll(&infos); policy.update(infos); }
+//
+// Both lists need the packets the decision reads: charging state (21),
+// charging sources (34) and mode (35). The active list should also carry the
+// requested velocities (39 - 42) for the motion check. The docked list is
+// queried in one request, up to ARDUROOMBA_QUERY_MAX_PACKETS packets.
+class ArduRoombaStreamPolicy
+{
+public:
+  ArduRoombaStreamPolicy(ArduRoomba &roomba, const ArduRoomba::StreamProfile &active, const ArduRoomba::StreamProfile &docked)
+      : _roomba(roomba), _active(active), _docked(docked) {}
+
+  bool begin(); // start with the active profile
+  void update(const ArduRoomba::RoombaInfos &infos); // after each poll()
+  void wake(); // back to the active profile now, before sending motion commands
+
+  void setDockDelay(unsigned int delay) { _dockDelay = delay; }
+  void setPolling(unsigned int interval) { _pollInterval = interval; } // ms, 0 streams the docked profile instead
+
+  byte state() const { return _state; }
+  bool docked() const { return _state == ARDUROOMBA_POLICY_DOCKED; }
+  unsigned int switches() const { return _switches; }
+
+  static bool looksDocked(const ArduRoomba::RoombaInfos &infos); // on a charger, in Off or Passive mode and not moving
+
+private:
+  ArduRoomba &_roomba;
+  const ArduRoomba::StreamProfile &_active;
+  const ArduRoomba::StreamProfile &_docked;
+  byte _state = ARDUROOMBA_POLICY_ACTIVE;
+  unsigned int _dockDelay = ARDUROOMBA_POLICY_DOCK_DELAY;
+  unsigned int _pollInterval = ARDUROOMBA_POLICY_POLL_INTERVAL;
+  unsigned long _dockedSince = 0; // millis() the robot started to look docked, 0 when it doesn't
+  unsigned long _polledAt = 0;
+  byte _undockSamples = 0;
+  long _sampleAt = 0; // lastSuccedRefresh of the last sample counted
+  unsigned int _switches = 0;
+
+  void _enterDocked();
+  void _enterActive();
+  void _query();
+};
+
+#endif
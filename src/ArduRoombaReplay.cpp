@@ -0,0 +1,99 @@
+#include "ArduRoombaReplay.h"
+
+#define ARDUROOMBA_REPLAY_WAIT 50 // ms to wait for a byte of a record already started
+
+void ArduRoombaReplay::begin(ArduRoomba &roomba, bool realTime)
+{
+  _roomba = &roomba;
+  _realTime = realTime;
+  _pending = false;
+  _dueFrom = millis();
+  _roomba->setExternalReceive(true);
+}
+
+int ArduRoombaReplay::_readByte()
+{
+  unsigned long start = millis();
+  while (!_recording.available()) {
+    if (millis() - start > ARDUROOMBA_REPLAY_WAIT) {
+      return -1;
+    }
+  }
+  return _recording.read();
+}
+
+bool ArduRoombaReplay::_readHeader()
+{
+  if (!_recording.available()) {
+    return false;
+  }
+  int low = _recording.read();
+  int high = _readByte();
+  if (high < 0) {
+    _truncated++;
+    return false;
+  }
+  _delay = low | (high << 8);
+  return true;
+}
+
+bool ArduRoombaReplay::service()
+{
+  if (!_pending) {
+    _pending = _readHeader();
+    if (!_pending) {
+      return false;
+    }
+  }
+  unsigned long now = millis();
+  if (_realTime && now - _dueFrom < _delay) {
+    return true; // not due yet
+  }
+  _dueFrom = _realTime ? _dueFrom + _delay : now; // keeps the recorded pace without drifting
+  _pending = false;
+
+  // header, size, content and checksum
+  int header = _readByte();
+  int size = _readByte();
+  if (header != ARDUROOMBA_STREAM_HEADER || size < 0) {
+    _truncated++;
+    return false;
+  }
+  _roomba->receiveByte(header);
+  _roomba->receiveByte(size);
+  for (int i = 0; i <= size; i++) {
+    int value = _readByte();
+    if (value < 0) {
+      _truncated++;
+      return false;
+    }
+    _roomba->receiveByte(value);
+  }
+  _frames++;
+  return true;
+}
+
+int ArduRoombaReplay::next(byte *frame, int size, unsigned int *delay)
+{
+  if (!_readHeader()) {
+    return -1;
+  }
+  if (delay) {
+    *delay = _delay;
+  }
+  int length = 0;
+  int content = 0;
+  for (int i = 0; i < 2 + content + 1; i++) {
+    int value = _readByte();
+    if (value < 0 || length == size) {
+      _truncated++;
+      return -1;
+    }
+    if (i == 1) {
+      content = value;
+    }
+    frame[length++] = value;
+  }
+  _frames++;
+  return length;
+}
@@ -0,0 +1,42 @@
+#ifndef ArduRoombaReplay_h
+#define ArduRoombaReplay_h
+
+#include "ArduRoomba.h"
+
+// Plays back a recording made with ArduRoomba::setRecorder(), from a File,
+// a Serial port or any Stream. The frames go through receiveByte() like
+// bytes from the link, so the same decoder, handlers and odometry run.
+//
+//   File log = LittleFS.open("/roomba.bin", "r");
+//   ArduRoombaReplay replay(log);
+//   replay.begin(roomba);          // external receive, the link is left alone
+//   while (replay.service()) {     // one frame fed when it's due
+//     roomba.poll(&infos);
+//   }
+class ArduRoombaReplay
+{
+public:
+  ArduRoombaReplay(Stream &recording) : _recording(recording) {}
+
+  void begin(ArduRoomba &roomba, bool realTime = true); // realTime false feeds a frame on each service()
+  bool service(); // feed the next frame once due, false at the end of the recording
+  int next(byte *frame, int size, unsigned int *delay = NULL); // read the next raw frame without feeding it, its length or -1
+
+  unsigned long frames() const { return _frames; } // frames fed or read so far
+  unsigned int truncated() const { return _truncated; } // records cut short
+
+private:
+  Stream &_recording;
+  ArduRoomba *_roomba = NULL;
+  bool _realTime = true;
+  bool _pending = false;    // the delay of the next record has been read
+  unsigned int _delay = 0;  // ms between the previous frame and the pending one
+  unsigned long _dueFrom = 0; // millis() the delay counts from
+  unsigned long _frames = 0;
+  unsigned int _truncated = 0;
+
+  bool _readHeader();
+  int _readByte(); // waits a little for slow sources, -1 at the end
+};
+
+#endif
@@ -0,0 +1,80 @@
+#include "ArduRoombaScheduler.h"
+
+bool ArduRoombaScheduler::addTask(Task task, unsigned int budget)
+{
+  if (_taskCount == ARDUROOMBA_SCHEDULER_MAX_TASKS) {
+    return false;
+  }
+  _tasks[_taskCount] = task;
+  _budgets[_taskCount] = budget;
+  _taskCount++;
+  return true;
+}
+
+long ArduRoombaScheduler::nextFrameIn() const
+{
+  return (long)(_predicted - micros());
+}
+
+void ArduRoombaScheduler::_frameArrived(unsigned long at)
+{
+  long period = _period >> 4;
+  if (!_started) {
+    _started = true;
+    _predicted = at + period;
+    return;
+  }
+  long error = (long)(at - _predicted);
+  while (error > period / 2) {
+    // frames were lost, their slots went by
+    _missed++;
+    _predicted += period;
+    error -= period;
+  }
+  _phaseError = error;
+  if (error < -period / 2) {
+    // far too early: another cadence, lock again from this frame
+    _lockCount = 0;
+    _predicted = at + period;
+    return;
+  }
+
+  // second order loop: the phase follows a quarter of the error, the
+  // period a 64th of it
+  _period += error >> 2;
+  _predicted += period + (error >> 2);
+  if (abs(error) < period / 4) {
+    if (_lockCount < ARDUROOMBA_SCHEDULER_LOCK) {
+      _lockCount++;
+    }
+  } else {
+    _lockCount = 0;
+  }
+}
+
+bool ArduRoombaScheduler::run(ArduRoomba::RoombaInfos *infos)
+{
+  bool decoded = _roomba.poll(infos);
+  if (decoded) {
+    _frameArrived(micros());
+  } else if (_started && (long)(micros() - _predicted) > (long)(_period >> 5)) {
+    // half a period late without a frame, the next one is one slot further
+    _missed++;
+    _predicted += _period >> 4;
+    _lockCount = 0;
+  }
+  if (!_taskCount) {
+    return decoded;
+  }
+
+  // before the loop locks, tasks run as they come
+  Task task = _tasks[_nextTask];
+  unsigned int budget = _budgets[_nextTask];
+  if (!locked() || nextFrameIn() > (long)budget + ARDUROOMBA_SCHEDULER_GUARD) {
+    _nextTask = (_nextTask + 1) % _taskCount;
+    task();
+  } else if (decoded) {
+    _skipped++; // the gap right after a frame was too short, the task waits for the next one
+  }
+  return decoded;
+}
@@ -0,0 +1,59 @@
+#ifndef ArduRoombaScheduler_h
+#define ArduRoombaScheduler_h
+
+#include "ArduRoomba.h"
+
+#ifndef ARDUROOMBA_SCHEDULER_MAX_TASKS
+#define ARDUROOMBA_SCHEDULER_MAX_TASKS 4
+#endif
+#define ARDUROOMBA_SCHEDULER_GUARD 1000 // us kept free before a predicted frame
+#define ARDUROOMBA_SCHEDULER_LOCK 8     // frames within a quarter period before the loop counts as locked
+
+// Runs the sketch around the stream cadence instead of a fixed delay. A
+// phase-locked loop learns the period and phase of the frames. run() polls
+// the link, so the frame handlers fire as soon as a frame is complete. The
+// tasks only run in the gap before the next predicted frame, when their
+// budget fits.
+//
+//   ArduRoombaScheduler scheduler(roomba);
+//   scheduler.addTask(updateDisplay, 3000); // budget in us
+//   void loop() { scheduler.run(&infos); }
+//
+// Times are micros(). phaseError() says how far the last frame landed from
+// its prediction, once locked it stays within the jitter of the link.
+class ArduRoombaScheduler
+{
+public:
+  typedef void (*Task)();
+
+  ArduRoombaScheduler(ArduRoomba &roomba) : _roomba(roomba) {}
+
+  bool addTask(Task task, unsigned int budget); // false when ARDUROOMBA_SCHEDULER_MAX_TASKS are there
+  bool run(ArduRoomba::RoombaInfos *infos);     // poll, then one task if it fits before the next frame; true if a frame was decoded
+
+  bool locked() const { return _lockCount >= ARDUROOMBA_SCHEDULER_LOCK; }
+  long phaseError() const { return _phaseError; }      // us, last frame minus its prediction
+  unsigned long period() const { return _period >> 4; } // us between frames, measured
+  long nextFrameIn() const;                             // us until the predicted frame, negative when late
+  unsigned long missedFrames() const { return _missed; }
+  unsigned long skippedTasks() const { return _skipped; } // task turns given up for lack of time
+
+private:
+  ArduRoomba &_roomba;
+  Task _tasks[ARDUROOMBA_SCHEDULER_MAX_TASKS];
+  unsigned int _budgets[ARDUROOMBA_SCHEDULER_MAX_TASKS];
+  byte _taskCount = 0;
+  byte _nextTask = 0;
+
+  bool _started = false;
+  unsigned long _predicted = 0; // micros() of the next frame
+  unsigned long _period = (unsigned long)ARDUROOMBA_STREAM_SLOT * 1000 << 4; // 4 fractional bits
+  long _phaseError = 0;
+  byte _lockCount = 0;
+  unsigned long _missed = 0;
+  unsigned long _skipped = 0;
+
+  void _frameArrived(unsigned long at);
+};
+
+#endif
@@ -0,0 +1,217 @@
+#ifndef ArduRoombaSignals_h
+#define ArduRoombaSignals_h
+
+#include "ArduRoomba.h"
+
+#define ARDUROOMBA_SIGNAL_CHANNELS 11 // wall, 4 cliffs and 6 light bumps: packets 27 - 31, 46 - 51
+#define ARDUROOMBA_SIGNAL_MAX 4095    // largest signal value, see the packet table
+#define ARDUROOMBA_SIGNAL_FRACTION 4  // fractional bits of the EMA state, 4095 << 4 still fits 16 bits
+
+// Filters run over the 11 channels at once, picked as the template parameter
+// of ArduRoombaSignals. The first frame goes through reset(), the next ones
+// through apply().
+
+// Exponential moving average, new = old + (raw - old) / 2^Shift, on 16 bit
+// fixed point. Shift 1 reacts within a few frames, 4 smooths over about 16.
+template <byte Shift = 2>
+class ArduRoombaEma
+{
+public:
+  void reset(const uint16_t *raw)
+  {
+    for (byte i = 0; i < ARDUROOMBA_SIGNAL_CHANNELS; i++) {
+      _state[i] = _clip(raw[i]) << ARDUROOMBA_SIGNAL_FRACTION;
+    }
+  }
+  void apply(const uint16_t *raw, uint16_t *out)
+  {
+    for (byte i = 0; i < ARDUROOMBA_SIGNAL_CHANNELS; i++) {
+      // old - old / 2^Shift + raw / 2^Shift, no step goes over 16 bits
+      uint16_t state = _state[i];
+      state = state - (state >> Shift) + ((uint16_t)(_clip(raw[i]) << ARDUROOMBA_SIGNAL_FRACTION) >> Shift);
+      _state[i] = state;
+      out[i] = ((state >> (ARDUROOMBA_SIGNAL_FRACTION - 1)) + 1) >> 1; // rounded
+    }
+  }
+
+private:
+  uint16_t _state[ARDUROOMBA_SIGNAL_CHANNELS];
+
+  static uint16_t _clip(uint16_t raw) { return raw < ARDUROOMBA_SIGNAL_MAX ? raw : ARDUROOMBA_SIGNAL_MAX; }
+
+  static_assert(Shift >= 1 && Shift <= ARDUROOMBA_SIGNAL_FRACTION, "EMA shift out of range");
+};
+
+// Median of the last Window frames, drops single frame spikes without the lag
+// of an average on steps. Takes Window * 22 bytes.
+template <byte Window = 3>
+class ArduRoombaMedian
+{
+public:
+  void reset(const uint16_t *raw)
+  {
+    for (byte i = 0; i < ARDUROOMBA_SIGNAL_CHANNELS; i++) {
+      for (byte j = 0; j < Window; j++) {
+        _window[i][j] = raw[i];
+      }
+    }
+    _next = 0;
+  }
+  void apply(const uint16_t *raw, uint16_t *out)
+  {
+    for (byte i = 0; i < ARDUROOMBA_SIGNAL_CHANNELS; i++) {
+      _window[i][_next] = raw[i];
+      // insertion sort of a copy, a handful of values
+      uint16_t sorted[Window];
+      for (byte j = 0; j < Window; j++) {
+        uint16_t value = _window[i][j];
+        byte k = j;
+        for (; k > 0 && sorted[k - 1] > value; k--) {
+          sorted[k] = sorted[k - 1];
+        }
+        sorted[k] = value;
+      }
+      out[i] = sorted[Window / 2];
+    }
+    _next = (_next + 1) % Window;
+  }
+
+private:
+  uint16_t _window[ARDUROOMBA_SIGNAL_CHANNELS][Window];
+  byte _next = 0; // slot of the next frame, the same in every channel
+
+  static_assert(Window >= 3 && Window <= 9 && (Window & 1), "median window must be odd, 3 - 9");
+};
+
+// Filtered analog signals, with threshold and hysteresis detection. Attached
+// with ArduRoomba::setSignals(), it is updated by the decoder on every frame,
+// before the frame handler, so onFrame() reads filtered values. Channels the
+// stream doesn't carry keep the last value decoded.
+//
+//   ArduRoombaSignals<ArduRoombaMedian<5>> signals;
+//   void onEdge(byte packetID, byte previous, byte current) { ... } // current is 1 above the threshold
+//   void setup() {
+//     signals.setThreshold(ARDUROOMBA_SENSOR_LIGHTBUMPCENTERLEFTSIGNAL, 600, 400);
+//     signals.onEdge(onEdge);
+//     roomba.setSignals(&signals);
+//   }
+//   ...
+//   uint16_t wall = signals.value(ARDUROOMBA_SENSOR_WALLSIGNAL);
+//
+// Channels are numbered in packet order, 0 for the wall signal up to 10 for
+// the right light bump. Bit masks use the same numbers.
+template <class Filter = ArduRoombaEma<>>
+class ArduRoombaSignals
+{
+public:
+  // Active once the filtered value reaches on, inactive again when it falls
+  // below off. False for other packets or off above on.
+  bool setThreshold(byte packetID, uint16_t on, uint16_t off)
+  {
+    int index = channel(packetID);
+    if (index < 0 || off > on) {
+      return false;
+    }
+    uint16_t bit = 1 << index;
+    _on[index] = on;
+    _off[index] = off;
+    _thresholds |= bit;
+    _active &= ~bit; // may rise again on the next frame
+    return true;
+  }
+  void clearThreshold(byte packetID)
+  {
+    int index = channel(packetID);
+    if (index >= 0) {
+      _thresholds &= ~(1 << index);
+      _active &= ~(1 << index);
+    }
+  }
+  void onEdge(ArduRoomba::SensorHandler handler) { _edgeHandler = handler; } // previous and current state, 0 or 1
+  void reset() { _primed = false; } // the next frame seeds the filter again
+
+  void update(const ArduRoomba::RoombaInfos &infos) // once per frame, done by the decoder once attached
+  {
+    const uint16_t *raw = &infos.wallSignal; // the 11 words follow each other
+    if (!_primed) {
+      _filter.reset(raw);
+      _primed = true;
+    }
+    _filter.apply(raw, _values);
+
+    uint16_t previous = _active;
+    for (byte i = 0; i < ARDUROOMBA_SIGNAL_CHANNELS; i++) {
+      uint16_t bit = 1 << i;
+      if (!(_thresholds & bit)) {
+        continue;
+      }
+      if (_values[i] >= (_active & bit ? _off[i] : _on[i])) {
+        _active |= bit;
+      } else {
+        _active &= ~bit;
+      }
+    }
+    _rising = _active & ~previous;
+    _falling = previous & ~_active;
+
+    uint16_t edges = _rising | _falling;
+    for (byte i = 0; edges && _edgeHandler && i < ARDUROOMBA_SIGNAL_CHANNELS; i++) {
+      uint16_t bit = 1 << i;
+      if (edges & bit) {
+        _edgeHandler(packetID(i), (previous & bit) != 0, (_active & bit) != 0);
+      }
+    }
+  }
+
+  uint16_t value(byte packetID) const // filtered, 0 for other packets
+  {
+    int index = channel(packetID);
+    return index >= 0 ? _values[index] : 0;
+  }
+  uint16_t channelValue(byte index) const { return _values[index]; }
+  bool active(byte packetID) const
+  {
+    int index = channel(packetID);
+    return index >= 0 && (_active & (1 << index));
+  }
+  uint16_t activeChannels() const { return _active; }
+  uint16_t rising() const { return _rising; }   // channels activated by the last frame
+  uint16_t falling() const { return _falling; } // channels released by the last frame
+
+  static int channel(byte packetID) // -1 for other packets
+  {
+    if (packetID >= ARDUROOMBA_SENSOR_WALLSIGNAL && packetID <= ARDUROOMBA_SENSOR_CLIFFRIGHTSIGNAL) {
+      return packetID - ARDUROOMBA_SENSOR_WALLSIGNAL;
+    }
+    if (packetID >= ARDUROOMBA_SENSOR_LIGHTBUMPLEFTSIGNAL && packetID <= ARDUROOMBA_SENSOR_LIGHTBUMPRIGHTSIGNAL) {
+      return packetID - ARDUROOMBA_SENSOR_LIGHTBUMPLEFTSIGNAL + 5;
+    }
+    return -1;
+  }
+  static byte packetID(byte index)
+  {
+    return index < 5 ? ARDUROOMBA_SENSOR_WALLSIGNAL + index : ARDUROOMBA_SENSOR_LIGHTBUMPLEFTSIGNAL + index - 5;
+  }
+
+  static void stage(void *signals, const ArduRoomba::RoombaInfos &infos) // called by the decoder
+  {
+    ((ArduRoombaSignals *)signals)->update(infos);
+  }
+
+private:
+  Filter _filter;
+  uint16_t _values[ARDUROOMBA_SIGNAL_CHANNELS] = {};
+  uint16_t _on[ARDUROOMBA_SIGNAL_CHANNELS];
+  uint16_t _off[ARDUROOMBA_SIGNAL_CHANNELS];
+  uint16_t _thresholds = 0; // channels with a threshold
+  uint16_t _active = 0;
+  uint16_t _rising = 0, _falling = 0;
+  bool _primed = false;
+  ArduRoomba::SensorHandler _edgeHandler = NULL;
+
+  static_assert(offsetof(ArduRoomba::RoombaInfos, lightBumpRightSignal) - offsetof(ArduRoomba::RoombaInfos, wallSignal) ==
+                    (ARDUROOMBA_SIGNAL_CHANNELS - 1) * sizeof(uint16_t),
+                "the signal fields must be contiguous");
+};
+
+#endif
@@ -0,0 +1,155 @@
+#include "ArduRoombaTask.h"
+
+#if defined(ARDUINO_ARCH_ESP32)
+
+bool ArduRoombaTask::begin(byte core, byte priority)
+{
+  if (running()) {
+    return true;
+  }
+  _state.store(STATE_RUNNING, std::memory_order_release);
+  if (xTaskCreatePinnedToCore(_taskEntry, "ArduRoomba", ARDUROOMBA_TASK_STACK, this, priority, NULL, core) != pdPASS) {
+    _state.store(STATE_STOPPED, std::memory_order_release);
+    return false;
+  }
+  return true;
+}
+
+void ArduRoombaTask::end()
+{
+  byte expected = STATE_RUNNING;
+  if (!_state.compare_exchange_strong(expected, STATE_STOPPING, std::memory_order_acq_rel)) {
+    return;
+  }
+  while (running()) {
+    vTaskDelay(1);
+  }
+}
+
+void ArduRoombaTask::_taskEntry(void *self)
+{
+  ArduRoombaTask *task = (ArduRoombaTask *)self;
+  task->_run();
+  task->_state.store(STATE_STOPPED, std::memory_order_release);
+  vTaskDelete(NULL);
+}
+
+void ArduRoombaTask::_run()
+{
+  TickType_t period = pdMS_TO_TICKS(ARDUROOMBA_TASK_PERIOD);
+  while (_state.load(std::memory_order_acquire) == STATE_RUNNING) {
+    _serviceCommands();
+    if (_roomba.poll(&_infos)) {
+      _publish();
+    }
+    vTaskDelay(period ? period : 1);
+  }
+}
+
+void ArduRoombaTask::_publish()
+{
+  // seqlock: odd while writing, readers retry if the count moved
+  uint32_t sequence = _sequence.load(std::memory_order_relaxed);
+  _sequence.store(sequence + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  memcpy(&_shared, &_infos, sizeof(_shared));
+  _sequence.store(sequence + 2, std::memory_order_release);
+}
+
+bool ArduRoombaTask::snapshot(ArduRoomba::RoombaInfos *infos, unsigned long *frame) const
+{
+  // the task has a higher priority, a copy interrupted by a write is retried
+  for (;;) {
+    uint32_t before = _sequence.load(std::memory_order_acquire);
+    if (before == 0) {
+      return false;
+    }
+    if (before & 1) {
+      continue;
+    }
+    memcpy(infos, &_shared, sizeof(_shared));
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (_sequence.load(std::memory_order_relaxed) == before) {
+      if (frame) {
+        *frame = before >> 1;
+      }
+      return true;
+    }
+  }
+}
+
+bool ArduRoombaTask::_push(byte kind, int first, int second, int third, const ArduRoomba::StreamProfile *profile)
+{
+  byte head = _queueHead.load(std::memory_order_relaxed);
+  if ((byte)(head - _queueTail.load(std::memory_order_acquire)) == ARDUROOMBA_TASK_QUEUE_SIZE) {
+    _dropped++;
+    return false;
+  }
+  Command &command = _queue[head % ARDUROOMBA_TASK_QUEUE_SIZE];
+  command.kind = kind;
+  command.first = first;
+  command.second = second;
+  command.third = third;
+  command.profile = profile;
+  _queueHead.store(head + 1, std::memory_order_release);
+  return true;
+}
+
+void ArduRoombaTask::_serviceCommands()
+{
+  if (_haltRequest.exchange(false, std::memory_order_acquire)) {
+    _queueTail.store(_queueHead.load(std::memory_order_acquire), std::memory_order_release);
+    _roomba.setDrive(0, 0); // same as the halt, serviceDrive() won't send an older setpoint again
+    _roomba.halt();
+    return;
+  }
+
+  byte tail = _queueTail.load(std::memory_order_relaxed);
+  byte head = _queueHead.load(std::memory_order_acquire);
+  if (tail == head) {
+    return;
+  }
+  _roomba.beginCommands(); // everything queued since the last pass leaves in one write
+  for (; tail != head; tail++) {
+    const Command &command = _queue[tail % ARDUROOMBA_TASK_QUEUE_SIZE];
+    switch (command.kind) {
+    case COMMAND_DRIVE:
+      _roomba.setDrive(command.first, command.second);
+      break;
+    case COMMAND_DRIVE_DIRECT:
+      _roomba.setDriveDirect(command.first, command.second);
+      break;
+    case COMMAND_MOTORS:
+      _roomba.motors(command.first);
+      break;
+    case COMMAND_LEDS:
+      _roomba.leds(command.first, command.second, command.third);
+      break;
+    case COMMAND_PLAY:
+      _roomba.play(command.first);
+      break;
+    case COMMAND_SAFE:
+      _roomba.safe();
+      break;
+    case COMMAND_FULL:
+      _roomba.full();
+      break;
+    case COMMAND_PROFILE:
+      _roomba.setStreamProfile(*command.profile);
+      break;
+    }
+  }
+  _roomba.endCommands();
+  _queueTail.store(tail, std::memory_order_release);
+}
+
+bool ArduRoombaTask::drive(int velocity, int radius) { return _push(COMMAND_DRIVE, velocity, radius); }
+bool ArduRoombaTask::driveDirect(int rightVelocity, int leftVelocity) { return _push(COMMAND_DRIVE_DIRECT, rightVelocity, leftVelocity); }
+bool ArduRoombaTask::motors(byte data) { return _push(COMMAND_MOTORS, data); }
+bool ArduRoombaTask::leds(int ledBits, int powerColor, int powerIntensity) { return _push(COMMAND_LEDS, ledBits, powerColor, powerIntensity); }
+bool ArduRoombaTask::play(int songNumber) { return _push(COMMAND_PLAY, songNumber); }
+bool ArduRoombaTask::safe() { return _push(COMMAND_SAFE); }
+bool ArduRoombaTask::full() { return _push(COMMAND_FULL); }
+bool ArduRoombaTask::setStreamProfile(const ArduRoomba::StreamProfile &profile) { return _push(COMMAND_PROFILE, 0, 0, 0, &profile); }
+
+#endif
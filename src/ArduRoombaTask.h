@@ -0,0 +1,110 @@
+#ifndef ArduRoombaTask_h
+#define ArduRoombaTask_h
+
+#include "ArduRoomba.h"
+
+#if defined(ARDUINO_ARCH_ESP32)
+#include <atomic>
+
+#ifndef ARDUROOMBA_TASK_QUEUE_SIZE
+#define ARDUROOMBA_TASK_QUEUE_SIZE 16 // commands waiting for the I/O task, a power of 2 up to 128
+#endif
+#define ARDUROOMBA_TASK_STACK 4096
+#define ARDUROOMBA_TASK_PRIORITY 5 // above loop(), which runs at 1
+#define ARDUROOMBA_TASK_CORE 1     // the Wi-Fi stack runs on core 0
+#define ARDUROOMBA_TASK_PERIOD 1   // ms between two polls of the link
+
+// ESP32 only: a FreeRTOS task pinned to one core owns the ArduRoomba object.
+// It decodes the stream, publishes every frame to a seqlock snapshot and
+// sends the commands queued by the application, so Wi-Fi or HTTP work in
+// loop() doesn't delay the stream or a stop.
+//
+//   ArduRoomba roomba(Serial2, 4);
+//   ArduRoombaTask io(roomba);
+//   void setup() { roomba.roombaSetup(); roomba.queryStream(list); io.begin(); }
+//   void loop() { io.snapshot(&infos); io.drive(200, ARDUROOMBA_RADIUS_STRAIGHT); ... }
+//
+// Once begin() returned, only the task calls the ArduRoomba object: frame and
+// safety handlers run in the task. Commands are queued by a single producer,
+// one application task (loop() usually).
+class ArduRoombaTask
+{
+public:
+  ArduRoombaTask(ArduRoomba &roomba) : _roomba(roomba) {}
+
+  bool begin(byte core = ARDUROOMBA_TASK_CORE, byte priority = ARDUROOMBA_TASK_PRIORITY); // false if the task couldn't be created
+  void end(); // stop the task, waits for its last pass
+  bool running() const { return _state.load(std::memory_order_acquire) != STATE_STOPPED; }
+
+  // Newest decoded frame, false before the first one. frame counts the
+  // frames published, to tell a new snapshot from the previous one.
+  bool snapshot(ArduRoomba::RoombaInfos *infos, unsigned long *frame = NULL) const;
+  unsigned long frames() const { return _sequence.load(std::memory_order_acquire) >> 1; }
+
+  // Commands run by the task in queue order, false when the queue is full.
+  // drive() and driveDirect() set the drive setpoint, see ArduRoomba::setDrive().
+  bool drive(int velocity, int radius);
+  bool driveDirect(int rightVelocity, int leftVelocity);
+  bool motors(byte data);
+  bool leds(int ledBits, int powerColor, int powerIntensity);
+  bool play(int songNumber);
+  bool safe();
+  bool full();
+  bool setStreamProfile(const ArduRoomba::StreamProfile &profile); // the profile must outlive the stream
+
+  // Stop the wheels ahead of the queue, the commands still queued are dropped
+  void halt() { _haltRequest.store(true, std::memory_order_release); }
+  unsigned int droppedCommands() const { return _dropped; } // commands refused because the queue was full
+
+private:
+  enum
+  {
+    STATE_STOPPED,
+    STATE_RUNNING,
+    STATE_STOPPING // end() waits for the task to see it
+  };
+
+  enum
+  {
+    COMMAND_DRIVE,
+    COMMAND_DRIVE_DIRECT,
+    COMMAND_MOTORS,
+    COMMAND_LEDS,
+    COMMAND_PLAY,
+    COMMAND_SAFE,
+    COMMAND_FULL,
+    COMMAND_PROFILE
+  };
+
+  struct Command
+  {
+    byte kind;
+    int first, second, third;
+    const ArduRoomba::StreamProfile *profile;
+  };
+
+  ArduRoomba &_roomba;
+  std::atomic<byte> _state{STATE_STOPPED};
+
+  ArduRoomba::RoombaInfos _infos = {};  // written by poll() in the task
+  ArduRoomba::RoombaInfos _shared = {}; // last published frame
+  std::atomic<uint32_t> _sequence{0};   // odd while _shared is written
+
+  Command _queue[ARDUROOMBA_TASK_QUEUE_SIZE];
+  std::atomic<byte> _queueHead{0}; // next slot written by the application
+  std::atomic<byte> _queueTail{0}; // next slot run by the task
+  std::atomic<bool> _haltRequest{false};
+  unsigned int _dropped = 0;
+
+  static void _taskEntry(void *self);
+  void _run();
+  void _publish();
+  void _serviceCommands();
+  bool _push(byte kind, int first = 0, int second = 0, int third = 0, const ArduRoomba::StreamProfile *profile = NULL);
+
+  static_assert(ARDUROOMBA_TASK_QUEUE_SIZE <= 128 && (ARDUROOMBA_TASK_QUEUE_SIZE & (ARDUROOMBA_TASK_QUEUE_SIZE - 1)) == 0,
+                "the queue indexes wrap at 256");
+};
+
+#endif
+#endif
@@ -0,0 +1,193 @@
+#include "ArduRoombaTelemetry.h"
+
+#define ARDUROOMBA_TELEMETRY_HEADER 5 // magic, version, sequence and record count
+#define ARDUROOMBA_TELEMETRY_RECORD 4 // flags, delay and field bitmap
+#define ARDUROOMBA_TELEMETRY_HOLD 100 // ms a partial batch may wait
+
+bool ArduRoombaTelemetry::track(byte packetID)
+{
+  bool wide, isSigned;
+  if (_fieldCount == ARDUROOMBA_TELEMETRY_MAX_FIELDS ||
+      !ArduRoomba::sensorLocation(packetID, &_offsets[_fieldCount], &wide, &isSigned)) {
+    return false;
+  }
+  for (byte i = 0; i < _fieldCount; i++) {
+    if (_ids[i] == packetID) {
+      return false;
+    }
+  }
+  _ids[_fieldCount] = packetID;
+  if (wide) {
+    _wide |= 1 << _fieldCount;
+  }
+  _fieldCount++;
+  _keyframeWanted = true; // receivers have to learn the new field
+  return true;
+}
+
+void ArduRoombaTelemetry::setDestination(const IPAddress &ip, uint16_t port)
+{
+  _ip = ip;
+  _port = port;
+  _fixedDestination = true;
+  _keyframeWanted = true;
+}
+
+byte ArduRoombaTelemetry::_recordSize(uint16_t fields) const
+{
+  byte size = ARDUROOMBA_TELEMETRY_RECORD;
+  for (byte i = 0; i < _fieldCount; i++) {
+    if (fields & (1 << i)) {
+      size += (_wide & (1 << i)) ? 2 : 1;
+    }
+  }
+  return size;
+}
+
+void ArduRoombaTelemetry::record(const ArduRoomba::RoombaInfos &infos, const ArduRoomba::SensorMask &changed)
+{
+  _pending.merge(changed);
+  _keyframeChanges.merge(changed);
+  if (!_port) {
+    return; // nobody listens yet, the changes wait for the first keyframe
+  }
+  bool keyframe = _keyframeWanted || (_keyframeInterval && _sinceKeyframe >= _keyframeInterval);
+  // A record holds every field changed since the keyframe, not only since the
+  // previous record: a receiver that lost datagrams is right again with the
+  // next record it gets
+  uint16_t fields = 0;
+  bool fresh = keyframe;
+  for (byte i = 0; i < _fieldCount; i++) {
+    if (keyframe || _keyframeChanges.has(_ids[i])) {
+      fields |= 1 << i;
+    }
+    fresh = fresh || _pending.has(_ids[i]);
+  }
+  if (!fresh) {
+    return; // nothing changed, the receiver keeps the previous values
+  }
+
+  byte size = _recordSize(fields);
+  if (_length + size > ARDUROOMBA_TELEMETRY_BUFFER_SIZE) {
+    flush();
+  }
+  unsigned long now = millis();
+  if (_length == 0) {
+    _length = ARDUROOMBA_TELEMETRY_HEADER;
+    _records = 0;
+    _batchAt = now;
+  }
+  unsigned long elapsed = now - _recordAt;
+  _recordAt = now;
+
+  byte *out = _buffer + _length;
+  *out++ = keyframe ? ARDUROOMBA_TELEMETRY_KEYFRAME_FLAG : 0;
+  *out++ = elapsed < 0xFF ? elapsed : 0xFF;
+  *out++ = fields;
+  *out++ = fields >> 8;
+  const byte *snapshot = (const byte *)&infos;
+  for (byte i = 0; i < _fieldCount; i++) {
+    if (!(fields & (1 << i))) {
+      continue;
+    }
+    const byte *value = snapshot + _offsets[i];
+    if (_wide & (1 << i)) {
+      uint16_t wide = *(const uint16_t *)value;
+      *out++ = wide;
+      *out++ = wide >> 8;
+    } else {
+      *out++ = *value;
+    }
+  }
+  _length += size;
+  _records++;
+  _pending.clear();
+  if (keyframe) {
+    _keyframeChanges.clear();
+    _keyframeWanted = false;
+    _sinceKeyframe = 0;
+  } else {
+    _sinceKeyframe++;
+  }
+
+  if (_records >= _batch) {
+    flush();
+  }
+}
+
+bool ArduRoombaTelemetry::flush()
+{
+  if (_length == 0) {
+    return false;
+  }
+  _buffer[0] = ARDUROOMBA_TELEMETRY_MAGIC;
+  _buffer[1] = ARDUROOMBA_TELEMETRY_VERSION;
+  _buffer[2] = _sequence;
+  _buffer[3] = _sequence >> 8;
+  _buffer[4] = _records;
+  _sequence++;
+  byte length = _length;
+  _length = 0;
+  if (!_port) {
+    return false; // nobody to send to yet
+  }
+  // a datagram lost here is covered by the next keyframe
+  return _udp.beginPacket(_ip, _port) && _udp.write(_buffer, length) == length && _udp.endPacket();
+}
+
+void ArduRoombaTelemetry::service()
+{
+  while (_udp.parsePacket() > 0) {
+    _readCommand();
+  }
+  unsigned long now = millis();
+  if (_length && now - _batchAt > ARDUROOMBA_TELEMETRY_HOLD) {
+    flush();
+  }
+  if (_driving && _commandTimeout && now - _commandAt > _commandTimeout) {
+    // the sender went silent, don't keep driving blind
+    _driving = false;
+    _roomba.setDrive(0, 0);
+    _roomba.halt();
+  }
+}
+
+void ArduRoombaTelemetry::_readCommand()
+{
+  byte command[6] = {};
+  int length = _udp.read(command, sizeof(command));
+  if (length < 2 || command[0] != ARDUROOMBA_TELEMETRY_COMMAND) {
+    return;
+  }
+  if (!_fixedDestination && (!_port || !(_ip == _udp.remoteIP()) || _port != _udp.remotePort())) {
+    _ip = _udp.remoteIP(); // telemetry follows the controller
+    _port = _udp.remotePort();
+    _keyframeWanted = true;
+  }
+  int16_t first = command[2] | (command[3] << 8);
+  int16_t second = command[4] | (command[5] << 8);
+  _commands++;
+  switch (command[1]) {
+  case ARDUROOMBA_TELEMETRY_DRIVE:
+  case ARDUROOMBA_TELEMETRY_DRIVE_DIRECT:
+    if (length < 6) {
+      return;
+    }
+    if (command[1] == ARDUROOMBA_TELEMETRY_DRIVE) {
+      _roomba.setDrive(first, second);
+    } else {
+      _roomba.setDriveDirect(first, second);
+    }
+    _driving = true;
+    _commandAt = millis();
+    break;
+  case ARDUROOMBA_TELEMETRY_HALT:
+    _driving = false;
+    _roomba.setDrive(0, 0);
+    _roomba.halt();
+    break;
+  case ARDUROOMBA_TELEMETRY_KEYFRAME_REQUEST:
+    _keyframeWanted = true;
+    break;
+  }
+}
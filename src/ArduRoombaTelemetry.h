@@ -0,0 +1,97 @@
+#ifndef ArduRoombaTelemetry_h
+#define ArduRoombaTelemetry_h
+
+#include "ArduRoomba.h"
+#include <IPAddress.h>
+#include <Udp.h>
+
+#ifndef ARDUROOMBA_TELEMETRY_BUFFER_SIZE
+#define ARDUROOMBA_TELEMETRY_BUFFER_SIZE 128 // bytes of a datagram
+#endif
+#define ARDUROOMBA_TELEMETRY_MAX_FIELDS 16    // packets sent, one bit each in a record
+#define ARDUROOMBA_TELEMETRY_BATCH 4          // records per datagram
+#define ARDUROOMBA_TELEMETRY_KEYFRAME 32      // records between two keyframes
+
+// Datagram: magic, version, sequence (2 bytes), record count, then the
+// records. Record: flags, ms since the previous record, bitmap of the tracked
+// fields present (2 bytes), their values in tracked order, 1 or 2 bytes.
+// A record holds every field changed since the last keyframe. Multibyte
+// values are little endian.
+#define ARDUROOMBA_TELEMETRY_MAGIC 'R'
+#define ARDUROOMBA_TELEMETRY_VERSION 1
+#define ARDUROOMBA_TELEMETRY_KEYFRAME_FLAG 0x01 // every tracked field is present
+
+// Commands received on the same socket: magic 'C', a kind byte, then two
+// little endian int16 arguments for the drive commands
+#define ARDUROOMBA_TELEMETRY_COMMAND 'C'
+#define ARDUROOMBA_TELEMETRY_DRIVE 1        // velocity, radius, setDrive()
+#define ARDUROOMBA_TELEMETRY_DRIVE_DIRECT 2 // right, left velocity, setDriveDirect()
+#define ARDUROOMBA_TELEMETRY_HALT 3
+#define ARDUROOMBA_TELEMETRY_KEYFRAME_REQUEST 4 // the next record is a keyframe
+
+// Sends chosen RoombaInfos fields as binary UDP datagrams, on any UDP
+// implementation (WiFiUDP on ESP8266/ESP32). Only the fields changed since the
+// last keyframe are sent, so any record brings a receiver that lost datagrams
+// up to date, with a full keyframe at regular intervals. Several frames share
+// a datagram.
+//
+//   WiFiUDP udp;
+//   ArduRoombaTelemetry telemetry(roomba, udp);
+//   void onFrame(const ArduRoomba::RoombaInfos &infos, const ArduRoomba::SensorMask &changed) {
+//     telemetry.record(infos, changed);
+//   }
+//   void setup() { udp.begin(4210); telemetry.track(ARDUROOMBA_SENSOR_VOLTAGE); roomba.onFrame(onFrame); }
+//   void loop() { roomba.poll(&infos); telemetry.service(); }
+class ArduRoombaTelemetry
+{
+public:
+  ArduRoombaTelemetry(ArduRoomba &roomba, UDP &udp) : _roomba(roomba), _udp(udp) {}
+
+  bool track(byte packetID); // false for groups, unknown packets or when the fields are all used
+  void setDestination(const IPAddress &ip, uint16_t port); // without one, datagrams go to the last command sender
+  void setBatch(byte records) { _batch = records ? records : 1; }
+  void setKeyframeInterval(byte records) { _keyframeInterval = records; }
+  void setCommandTimeout(unsigned int timeout) { _commandTimeout = timeout; } // ms without drive commands before a halt, 0 never
+
+  void record(const ArduRoomba::RoombaInfos &infos, const ArduRoomba::SensorMask &changed); // once per frame
+  void service(); // read the commands received, send a partial batch left for too long
+  bool flush();   // send the records batched so far
+
+  uint16_t sequence() const { return _sequence; } // of the next datagram
+  unsigned long commands() const { return _commands; }
+
+private:
+  ArduRoomba &_roomba;
+  UDP &_udp;
+  IPAddress _ip;
+  uint16_t _port = 0;
+  bool _fixedDestination = false;
+
+  byte _ids[ARDUROOMBA_TELEMETRY_MAX_FIELDS];
+  byte _offsets[ARDUROOMBA_TELEMETRY_MAX_FIELDS];
+  uint16_t _wide = 0; // bit per field sent on 2 bytes
+  byte _fieldCount = 0;
+
+  byte _buffer[ARDUROOMBA_TELEMETRY_BUFFER_SIZE];
+  byte _length = 0;  // bytes of the datagram being built, 0 when empty
+  byte _records = 0; // records in it
+  byte _batch = ARDUROOMBA_TELEMETRY_BATCH;
+  byte _keyframeInterval = ARDUROOMBA_TELEMETRY_KEYFRAME;
+  byte _sinceKeyframe = 0;
+  bool _keyframeWanted = true;
+  uint16_t _sequence = 0;
+  ArduRoomba::SensorMask _pending = {}; // changed since the last record
+  ArduRoomba::SensorMask _keyframeChanges = {}; // changed since the last keyframe, sent in every record
+  unsigned long _recordAt = 0;          // millis() of the last record
+  unsigned long _batchAt = 0;           // millis() of the first record of the datagram
+
+  unsigned int _commandTimeout = 0;
+  unsigned long _commandAt = 0;
+  bool _driving = false; // a drive command is running under the timeout
+  unsigned long _commands = 0;
+
+  byte _recordSize(uint16_t fields) const;
+  void _readCommand();
+};
+
+#endif